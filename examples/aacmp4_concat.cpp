@@ -0,0 +1,49 @@
+// SPDX-License-Identifier: BSL-1.0
+// Copyright Kenta Ida 2023.
+// Distributed under the Boost Software License, Version 1.0.
+//    (See accompanying file LICENSE_1_0.txt or copy at
+//          https://www.boost.org/LICENSE_1_0.txt)
+
+// Concatenates MP4 files written by this library without re-encoding.
+// usage: aacmp4_concat <output.mp4> <input.mp4>...
+
+#include <cstdint>
+#include <cstdio>
+
+#include "aacmp4_edit.hpp"
+
+using namespace std;
+
+int main(int argc, char** argv)
+{
+    if(argc < 3) {
+        printf("usage: %s <output.mp4> <input.mp4>...\n", argv[0]);
+        return 1;
+    }
+
+    const AACMP4::EditResult result = AACMP4::concat_aac_mp4(argv[1], argv + 2, size_t(argc - 2));
+    switch(result.error) {
+    case AACMP4::EditError::None:
+        break;
+    case AACMP4::EditError::Io:
+        printf("I/O error\n");
+        return 1;
+    case AACMP4::EditError::Read:
+        printf("cannot parse %s\n", argv[2 + result.input]);
+        return 1;
+    case AACMP4::EditError::Incompatible:
+        printf("the format of %s differs from %s\n", argv[2 + result.input], argv[2]);
+        return 1;
+    case AACMP4::EditError::NoFrames:
+        printf("no frames\n");
+        return 1;
+    case AACMP4::EditError::TooLong:
+        printf("the result is too long\n");
+        return 1;
+    }
+    printf("%llu frames, %llu bytes, %llu bytes copied in the kernel\n",
+        static_cast<unsigned long long>(result.number_of_frames),
+        static_cast<unsigned long long>(result.file_size),
+        static_cast<unsigned long long>(result.kernel_copied_bytes));
+    return 0;
+}
@@ -0,0 +1,63 @@
+// SPDX-License-Identifier: BSL-1.0
+// Copyright Kenta Ida 2023.
+// Distributed under the Boost Software License, Version 1.0.
+//    (See accompanying file LICENSE_1_0.txt or copy at
+//          https://www.boost.org/LICENSE_1_0.txt)
+
+// Rebuilds moov of an MP4 file left unfinished by AacMp4Writer, from the journal written alongside it.
+// usage: aacmp4_recover <file.mp4> <journal>
+
+#include <cstdint>
+#include <cstdio>
+#include <filesystem>
+#include <fstream>
+#include <iterator>
+#include <vector>
+
+#include "aacmp4_journal.hpp"
+#include "stream_adapter.hpp"
+
+using namespace std;
+
+int main(int argc, char** argv)
+{
+    if(argc < 3) {
+        printf("usage: %s <file.mp4> <journal>\n", argv[0]);
+        return 1;
+    }
+
+    ifstream journal_file(argv[2], ios::binary);
+    vector<uint8_t> journal((istreambuf_iterator<char>(journal_file)), istreambuf_iterator<char>());
+
+    error_code error;
+    const uint64_t file_size = filesystem::file_size(argv[1], error);
+    if(error) {
+        printf("cannot open %s: %s\n", argv[1], error.message().c_str());
+        return 1;
+    }
+
+    AACMP4::RecoveryResult result;
+    {
+        fstream file(argv[1], ios::binary | ios::in | ios::out);
+        auto adapter = AACMP4::StreamAdapter(file);
+        result = AACMP4::recover_aac_mp4(adapter, file_size, journal.data(), journal.size());
+    }
+    switch(result.error) {
+    case AACMP4::RecoveryError::None:
+        break;
+    case AACMP4::RecoveryError::BadJournal:
+        printf("invalid journal: %s\n", argv[2]);
+        return 1;
+    case AACMP4::RecoveryError::NoFrames:
+        printf("no complete frame in %s\n", argv[1]);
+        return 1;
+    }
+
+    filesystem::resize_file(argv[1], result.file_size, error);
+    if(error) {
+        printf("cannot truncate %s: %s\n", argv[1], error.message().c_str());
+        return 1;
+    }
+    printf("recovered %zu frames, %llu bytes\n", result.number_of_frames, static_cast<unsigned long long>(result.file_size));
+    return 0;
+}
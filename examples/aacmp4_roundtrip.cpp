@@ -0,0 +1,256 @@
+// SPDX-License-Identifier: BSL-1.0
+// Copyright Kenta Ida 2023.
+// Distributed under the Boost Software License, Version 1.0.
+//    (See accompanying file LICENSE_1_0.txt or copy at
+//          https://www.boost.org/LICENSE_1_0.txt)
+
+// Writes files with AacMp4Writer, joins and trims them, reopens the results with Reader and checks the sample
+// tables and the edit lists.
+// usage: aacmp4_roundtrip [directory]
+// The files are written into the directory, the current one by default. Exits with 1 if a check fails.
+
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include "aacmp4_writer.hpp"
+#include "aacmp4_edit.hpp"
+
+using namespace std;
+using namespace AACMP4;
+
+static int failures = 0;
+
+#define CHECK(condition) do { \
+    if(!(condition)) { \
+        fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #condition); \
+        failures++; \
+    } \
+} while(0)
+
+static const char STCO[] = "moovtrakmdiaminfstblstco";
+static const char STSC[] = "moovtrakmdiaminfstblstsc";
+static const char ELST[] = "moovtrakedtselst";
+
+static uint32_t read_be32(const uint8_t* p)
+{
+    return (uint32_t(p[0]) << 24) | (uint32_t(p[1]) << 16) | (uint32_t(p[2]) << 8) | uint32_t(p[3]);
+}
+
+static void write_be32(uint8_t* p, uint32_t value)
+{
+    p[0] = uint8_t(value >> 24);
+    p[1] = uint8_t(value >> 16);
+    p[2] = uint8_t(value >> 8);
+    p[3] = uint8_t(value);
+}
+
+// Returns the payload of the box at the path of four character types, e.g. "moovtrak", or nullptr.
+static const uint8_t* find_box(const uint8_t* data, size_t size, const char* path, size_t& payload_size)
+{
+    while(size >= 8) {
+        const size_t box_size = read_be32(data);
+        if(box_size < 8 || box_size > size) return nullptr;
+        if(memcmp(data + 4, path, 4) == 0) {
+            if(path[4] == '\0') {
+                payload_size = box_size - 8;
+                return data + 8;
+            }
+            return find_box(data + 8, box_size - 8, path + 4, payload_size);
+        }
+        data += box_size;
+        size -= box_size;
+    }
+    return nullptr;
+}
+
+struct File {
+    EditInput input;
+    vector<uint8_t> data;
+
+    bool open(const string& path) {
+        if(this->input.open(path.c_str()) != EditError::None) return false;
+        this->data.resize(this->input.size);
+        return FdSource{this->input.fd}.read_at(0, this->data.data(), this->data.size());
+    }
+    // Position of the payload of the box at the path, e.g. "moovtrakedtselst", in data. 0 if not found.
+    size_t box_position(const char* path) const {
+        size_t size = 0;
+        const uint8_t* payload = find_box(this->data.data(), this->data.size(), path, size);
+        return payload != nullptr ? size_t(payload - this->data.data()) : 0;
+    }
+    // Entries of the full box at the path, following the version, flags and entry count, fields values each.
+    vector<uint32_t> table(const char* path, size_t fields) const {
+        size_t size = 0;
+        const uint8_t* payload = find_box(this->data.data(), this->data.size(), path, size);
+        vector<uint32_t> values;
+        if(payload == nullptr || size < 8) return values;
+        const size_t count = read_be32(payload + 4);
+        for(size_t i = 0; i < count * fields && 8 + i * 4 + 4 <= size; i++) {
+            values.push_back(read_be32(payload + 8 + i * 4));
+        }
+        return values;
+    }
+};
+
+// Frame i of a file is filled with seed + i and its size is 20 + i % 30.
+static uint32_t frame_size(size_t index) { return uint32_t(20 + index % 30); }
+
+// Writes number_of_frames frames in batches of batch_size, starting with an empty batch.
+static bool write_file(const string& path, size_t number_of_frames, size_t batch_size, uint8_t seed, const WriterConfig& config = WriterConfig())
+{
+    const int fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if(fd < 0) return false;
+    bool succeeded;
+    {
+        FdSink sink(fd);
+        AacMp4Writer<FdSink> writer(sink, 48000, 1024, 2, config);
+        succeeded = writer.add_frames(static_cast<const u8*>(nullptr), static_cast<const uint32_t*>(nullptr), 0);
+        vector<u8> data;
+        vector<uint32_t> sizes;
+        for(size_t first = 0; first < number_of_frames; first += batch_size) {
+            data.clear();
+            sizes.clear();
+            for(size_t i = first; i < first + batch_size && i < number_of_frames; i++) {
+                sizes.push_back(frame_size(i));
+                data.insert(data.end(), frame_size(i), u8(seed + i));
+            }
+            succeeded = writer.add_frames(data.data(), sizes.data(), sizes.size()) && succeeded;
+        }
+        succeeded = writer.finalize() && succeeded;
+        sink.flush();
+        succeeded = sink.error() == 0 && succeeded;
+    }
+    return ::close(fd) == 0 && succeeded;
+}
+
+// Checks that frames [first, first + count) of the file hold frames [source_first, ...) written with seed.
+static void check_frames(const File& file, size_t first, size_t count, size_t source_first, uint8_t seed)
+{
+    const Reader& reader = file.input.reader;
+    for(size_t i = 0; i < count; i++) {
+        const SampleInfo sample = reader.sample(first + i);
+        const size_t source = source_first + i;
+        if(sample.size != frame_size(source) || sample.offset + sample.size > file.data.size()
+            || file.data[sample.offset] != u8(seed + source) || file.data[sample.offset + sample.size - 1] != u8(seed + source)) {
+            fprintf(stderr, "frame %zu differs from frame %zu of the input\n", first + i, source);
+            failures++;
+            return;
+        }
+    }
+}
+
+// An empty batch must not leave an empty chunk behind: all frames go into one chunk by default.
+static void check_writer(const string& directory)
+{
+    const string path = directory + "/roundtrip_writer.mp4";
+    CHECK(write_file(path, 100, 10, 0));
+    File file;
+    CHECK(file.open(path));
+    CHECK(file.input.reader.sample_count() == 100);
+    const vector<uint32_t> stco = file.table(STCO, 1);
+    const vector<uint32_t> stsc = file.table(STSC, 3);
+    CHECK(stco.size() == 1);
+    CHECK(stsc.size() == 3 && stsc[0] == 1 && stsc[1] == 100);
+    CHECK(!stco.empty() && file.input.reader.sample_offsets()[0] == stco[0]);
+    check_frames(file, 0, 100, 0, 0);
+}
+
+// Reader rejects stsc runs which do not start at the first chunk or whose first chunks do not increase.
+static void check_malformed_stsc(const string& directory)
+{
+    const string path = directory + "/roundtrip_chunks.mp4";
+    WriterConfig config;
+    config.chunk_policy.samples_per_chunk = 30;
+    CHECK(write_file(path, 100, 7, 0, config));
+    File file;
+    CHECK(file.open(path));
+    const vector<uint32_t> stsc = file.table(STSC, 3);
+    CHECK(stsc.size() == 6 && stsc[0] == 1 && stsc[1] == 30 && stsc[3] == 4 && stsc[4] == 10);
+    const size_t position = file.box_position(STSC);
+    CHECK(position != 0);
+    if(position == 0) return;
+
+    // The samples per chunk are adjusted so that the runs still cover all frames.
+    Reader reader;
+    vector<uint8_t> data = file.data;
+    write_be32(data.data() + position + 8, 2);
+    write_be32(data.data() + position + 8 + 4, 45);
+    CHECK(!reader.open(data.data(), data.size()) && reader.error() == ReadError::Malformed);
+    data = file.data;
+    write_be32(data.data() + position + 8 + 12, 1);
+    write_be32(data.data() + position + 8 + 16, 25);
+    CHECK(!reader.open(data.data(), data.size()) && reader.error() == ReadError::Malformed);
+    CHECK(reader.open(file.data.data(), file.data.size()));
+}
+
+// Two files written by the writer are joined, and each keeps its frames and gets its own edit.
+static void check_concat(const string& directory)
+{
+    const string first = directory + "/roundtrip_first.mp4";
+    const string second = directory + "/roundtrip_second.mp4";
+    const string output = directory + "/roundtrip_concat.mp4";
+    CHECK(write_file(first, 100, 16, 0));
+    CHECK(write_file(second, 50, 16, 100));
+    const char* inputs[] = {first.c_str(), second.c_str()};
+    const EditResult result = concat_aac_mp4(output.c_str(), inputs, 2);
+    CHECK(result.error == EditError::None && result.number_of_frames == 150);
+
+    File file;
+    CHECK(file.open(output));
+    const Reader& reader = file.input.reader;
+    CHECK(reader.sample_count() == 150);
+    CHECK(reader.movie_timescale() == 48000);
+    // Each input presents its frames without the 2048 priming samples, starting after the frames before it.
+    const vector<uint32_t> elst = file.table(ELST, 3);
+    CHECK(elst.size() == 6);
+    CHECK(elst.size() == 6 && elst[0] == 100 * 1024 - 2048 && elst[1] == 2048);
+    CHECK(elst.size() == 6 && elst[3] == 50 * 1024 - 2048 && elst[4] == 100 * 1024 + 2048);
+    // One chunk per input, the second right after the frames of the first.
+    uint32_t first_payload = 0;
+    for(size_t i = 0; i < 100; i++) first_payload += frame_size(i);
+    const vector<uint32_t> stco = file.table(STCO, 1);
+    CHECK(stco.size() == 2);
+    CHECK(stco.size() == 2 && stco[0] == reader.sample_offsets()[0] && stco[1] == stco[0] + first_payload);
+    CHECK(stco.size() == 2 && reader.sample_offsets()[100] == stco[1]);
+    check_frames(file, 0, 100, 0, 0);
+    check_frames(file, 100, 50, 0, 100);
+}
+
+// The range from 1 s to 1.5 s is cut out of a file with the covering frames and one pre-roll frame.
+static void check_trim(const string& directory)
+{
+    const string input = directory + "/roundtrip_first.mp4";
+    const string output = directory + "/roundtrip_trim.mp4";
+    const EditResult result = trim_aac_mp4(output.c_str(), input.c_str(), 48000, 72000);
+    CHECK(result.error == EditError::None);
+
+    File file;
+    CHECK(file.open(output));
+    const Reader& reader = file.input.reader;
+    // Samples 48000 + 2048 to 72000 + 2048 of the media lie in frames 48 to 72, preceded by frame 47.
+    CHECK(reader.sample_count() == 26);
+    const vector<uint32_t> elst = file.table(ELST, 3);
+    CHECK(elst.size() == 3 && elst[0] == 24000 && elst[1] == 48000 + 2048 - 47 * 1024);
+    CHECK(reader.media_time() == 1920 && reader.edit_duration() == 24000);
+    const vector<uint32_t> stco = file.table(STCO, 1);
+    CHECK(stco.size() == 1 && stco[0] == reader.sample_offsets()[0]);
+    check_frames(file, 0, 26, 47, 0);
+}
+
+int main(int argc, char* argv[])
+{
+    const string directory = argc > 1 ? argv[1] : ".";
+    check_writer(directory);
+    check_malformed_stsc(directory);
+    check_concat(directory);
+    check_trim(directory);
+    if(failures > 0) {
+        fprintf(stderr, "%d checks failed\n", failures);
+        return 1;
+    }
+    printf("all checks passed\n");
+    return 0;
+}
@@ -0,0 +1,76 @@
+// SPDX-License-Identifier: BSL-1.0
+// Copyright Kenta Ida 2023.
+// Distributed under the Boost Software License, Version 1.0.
+//    (See accompanying file LICENSE_1_0.txt or copy at
+//          https://www.boost.org/LICENSE_1_0.txt)
+
+// Extracts a time range of an MP4 file written by this library without re-encoding.
+// usage: aacmp4_trim <input.mp4> <output.mp4> <start> <end>
+// The times are given as [[hh:]mm:]ss[.fff], e.g. 00:41:10 00:42:05.
+
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+
+#include "aacmp4_edit.hpp"
+
+using namespace std;
+
+// Parses [[hh:]mm:]ss[.fff] into seconds. Returns a negative value if malformed.
+static double parse_time(const char* text)
+{
+    double seconds = 0;
+    for(;;) {
+        char* end;
+        const double value = strtod(text, &end);
+        if(end == text) return -1;
+        seconds = seconds * 60 + value;
+        if(*end == '\0') return seconds;
+        if(*end != ':') return -1;
+        text = end + 1;
+    }
+}
+
+int main(int argc, char** argv)
+{
+    if(argc < 5) {
+        printf("usage: %s <input.mp4> <output.mp4> <start> <end>\n", argv[0]);
+        return 1;
+    }
+    const double start = parse_time(argv[3]);
+    const double end = parse_time(argv[4]);
+    if(start < 0 || end < 0) {
+        printf("invalid time\n");
+        return 1;
+    }
+
+    // The times are converted to samples of the input.
+    uint32_t sample_rate;
+    {
+        AACMP4::EditInput input;
+        if(input.open(argv[1]) != AACMP4::EditError::None) {
+            printf("cannot read %s\n", argv[1]);
+            return 1;
+        }
+        sample_rate = input.reader.sample_rate();
+    }
+    const AACMP4::EditResult result = AACMP4::trim_aac_mp4(argv[2], argv[1], uint64_t(start * sample_rate + 0.5), uint64_t(end * sample_rate + 0.5));
+    switch(result.error) {
+    case AACMP4::EditError::None:
+        break;
+    case AACMP4::EditError::NoFrames:
+        printf("the range is empty\n");
+        return 1;
+    case AACMP4::EditError::TooLong:
+        printf("the range is too long\n");
+        return 1;
+    default:
+        printf("cannot trim %s\n", argv[1]);
+        return 1;
+    }
+    printf("%llu frames, %llu bytes, %llu bytes copied in the kernel\n",
+        static_cast<unsigned long long>(result.number_of_frames),
+        static_cast<unsigned long long>(result.file_size),
+        static_cast<unsigned long long>(result.kernel_copied_bytes));
+    return 0;
+}
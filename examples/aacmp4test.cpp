@@ -13,6 +13,7 @@
 #include <fdk-aac/aacenc_lib.h>
 
 #include "aacmp4.hpp"
+#include "segment_buffer.hpp"
 #include "stream_adapter.hpp"
 
 using namespace std;
@@ -69,10 +70,10 @@ int main()
     }
 
     auto frame_size = 1*2*info.frameLength;
-    std::vector<uint8_t> out_buffer;
-    out_buffer.reserve(info.maxOutBufBytes * 1024);
-    std::vector<AACMP4::u32> chunks;
-    chunks.reserve(1024);
+    // The encoded frames are appended to fixed-size blocks, so the buffer never reallocates nor copies them.
+    AACMP4::SegmentBuffer out_buffer;
+    std::vector<std::uint32_t> frame_sizes;
+    frame_sizes.reserve(1024);
 
     vector<uint8_t> input;
     ifstream input_file("../../ashita_asatte_16k.wav", ios::binary);
@@ -110,10 +111,8 @@ int main()
         in_buf.bufSizes = &in_size;
         in_buf.bufElSizes = &in_elem_size;
 
-        size_t out_offset = out_buffer.size();
-        out_buffer.resize(out_offset + info.maxOutBufBytes);
-        void* out_ptr = out_buffer.data() + out_offset;
-        int out_size = out_buffer.size() - out_offset;
+        void* out_ptr = out_buffer.acquire(info.maxOutBufBytes);
+        int out_size = info.maxOutBufBytes;
         int out_elem_size = 1;
         int out_identifier = OUT_BITSTREAM_DATA;
         out_buf.numBufs = 1;
@@ -134,9 +133,8 @@ int main()
         input_offset += in_args.numInSamples * 2;
         if(out_args.numOutBytes == 0) continue;
         printf("%d/%d\n", in_size, out_args.numOutBytes);
-        chunks.push_back(out_args.numOutBytes);
-        out_buffer.resize(out_offset + out_args.numOutBytes);
-        out_offset += out_args.numOutBytes;
+        frame_sizes.push_back(out_args.numOutBytes);
+        out_buffer.commit(out_args.numOutBytes);
     }
 
     aacEncClose(&handle);
@@ -144,7 +142,7 @@ int main()
     // write mp4
     ofstream output_file("output.mp4", ios::binary);
     auto adapter = AACMP4::StreamAdapter(output_file);
-    AACMP4::write_aac_mp4(adapter, chunks, out_buffer, 16000, input_offset / 2, info.frameLength);
+    AACMP4::write_aac_mp4(adapter, frame_sizes.data(), frame_sizes.size(), out_buffer, 16000, input_offset / 2, info.frameLength);
 
     return 0;
 }
\ No newline at end of file
@@ -0,0 +1,80 @@
+// SPDX-License-Identifier: BSL-1.0
+// Copyright Kenta Ida 2023.
+// Distributed under the Boost Software License, Version 1.0.
+//    (See accompanying file LICENSE_1_0.txt or copy at
+//          https://www.boost.org/LICENSE_1_0.txt)
+
+// Remuxes an ADTS stream (.aac) into an MP4 file without decoding it.
+// usage: adts2mp4 <input.aac> <output.mp4>
+
+#include <cstdint>
+#include <cstdio>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "adts.hpp"
+#include "stream_adapter.hpp"
+
+using namespace std;
+
+int main(int argc, char** argv)
+{
+    if(argc < 3) {
+        printf("usage: %s <input.aac> <output.mp4>\n", argv[0]);
+        return 1;
+    }
+
+    int input = open(argv[1], O_RDONLY);
+    struct stat st;
+    if(input < 0 || fstat(input, &st) != 0 || st.st_size == 0) {
+        printf("cannot open %s\n", argv[1]);
+        return 1;
+    }
+    void* mapping = mmap(nullptr, size_t(st.st_size), PROT_READ, MAP_PRIVATE, input, 0);
+    close(input);
+    if(mapping == MAP_FAILED) {
+        printf("cannot map %s\n", argv[1]);
+        return 1;
+    }
+    madvise(mapping, size_t(st.st_size), MADV_SEQUENTIAL);
+
+    int output = open(argv[2], O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if(output < 0) {
+        printf("cannot create %s\n", argv[2]);
+        return 1;
+    }
+    AACMP4::AdtsRemuxResult result;
+    int error;
+    {
+        AACMP4::FdSink sink(output);
+        result = AACMP4::remux_adts(sink, static_cast<const uint8_t*>(mapping), size_t(st.st_size));
+        sink.flush();
+        error = sink.error();
+    }
+    close(output);
+    munmap(mapping, size_t(st.st_size));
+
+    switch(result.error) {
+    case AACMP4::AdtsRemuxError::None:
+        break;
+    case AACMP4::AdtsRemuxError::NoFrames:
+        printf("no ADTS frame in %s\n", argv[1]);
+        return 1;
+    case AACMP4::AdtsRemuxError::UnsupportedChannels:
+        printf("channel configuration 0 is not supported\n");
+        return 1;
+    }
+    if(error != 0) {
+        printf("cannot write %s\n", argv[2]);
+        return 1;
+    }
+    printf("%llu frames, %llu bytes skipped, %llu resyncs, %llu frames rejected\n",
+        static_cast<unsigned long long>(result.stats.frames),
+        static_cast<unsigned long long>(result.stats.skipped_bytes),
+        static_cast<unsigned long long>(result.stats.resyncs),
+        static_cast<unsigned long long>(result.stats.rejected_frames));
+    return 0;
+}
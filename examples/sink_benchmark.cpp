@@ -0,0 +1,261 @@
+// SPDX-License-Identifier: BSL-1.0
+// Copyright Kenta Ida 2023.
+// Distributed under the Boost Software License, Version 1.0.
+//    (See accompanying file LICENSE_1_0.txt or copy at
+//          https://www.boost.org/LICENSE_1_0.txt)
+
+// Compares the number of ostream::write calls and the time to write an one hour file
+// with and without BufferedSink, both with the boxes serialized field by field as the original writer did
+// and in batches, and the time to build the sample size table per element and in bulk.
+// On POSIX systems, also compares the cost of the durability policies of DurableSink over FdSink.
+// Finally, passes frames from an encoder thread to a writer thread in buffers allocated per frame and taken from a FramePool.
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <thread>
+#include <vector>
+
+#include "aacmp4.hpp"
+#include "aacmp4_writer.hpp"
+#include "durable_sink.hpp"
+#include "frame_pool.hpp"
+#include "frame_queue.hpp"
+#include "stream_adapter.hpp"
+
+#ifdef AACMP4_HAS_FD_SINK
+#include <fcntl.h>
+#endif
+
+using namespace std;
+
+template<typename S>
+struct CountingSink {
+    S& stream;
+    size_t calls = 0;
+    CountingSink(S& stream) : stream(stream) {}
+
+    void write(const AACMP4::u8* data, size_t size) {
+        this->calls++;
+        this->stream.write(data, size);
+    }
+    size_t position(void) {
+        return this->stream.position();
+    }
+};
+
+// Splits every write of the box tree into writes of at most 4 bytes, the call pattern of the original writer
+// which wrote each u8/u16/u24/u32 field and each stsz and stco entry with its own stream.write().
+// The payload segments are passed on as they are, as the original writer wrote the payload in one call.
+template<typename S>
+struct PerFieldSink {
+    S& stream;
+    PerFieldSink(S& stream) : stream(stream) {}
+
+    void write(const AACMP4::u8* data, size_t size) {
+        for(size_t offset = 0; offset < size; offset += 4) {
+            this->stream.write(data + offset, size - offset < 4 ? size - offset : 4);
+        }
+    }
+    void write_segments(const AACMP4::Segment* segments, size_t count) {
+        for(size_t i = 0; i < count; i++) {
+            this->stream.write(segments[i].data, segments[i].size);
+        }
+    }
+    size_t position(void) {
+        return this->stream.position();
+    }
+};
+
+template<typename F>
+static void run(const char* name, F&& write_file)
+{
+    ofstream output_file("sink_benchmark.mp4", ios::binary);
+    auto adapter = AACMP4::StreamAdapter(output_file);
+    CountingSink<decltype(adapter)> counter(adapter);
+
+    auto start = chrono::steady_clock::now();
+    write_file(counter);
+    output_file.flush();
+    auto elapsed = chrono::duration_cast<chrono::microseconds>(chrono::steady_clock::now() - start);
+
+    printf("%-14s %10zu write calls %10lld us\n", name, counter.calls, static_cast<long long>(elapsed.count()));
+}
+
+#ifdef AACMP4_HAS_FD_SINK
+static void run_durable(const char* name, const AACMP4::DurabilityPolicy& policy, const AACMP4::ChunkPolicy& chunk_policy,
+                        const vector<uint32_t>& sizes, const vector<uint8_t>& data, uint32_t sample_rate, uint32_t frame_length)
+{
+    int fd = ::open("sink_benchmark_durable.mp4", O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if(fd < 0) return;
+    AACMP4::SyncStats stats;
+    auto start = chrono::steady_clock::now();
+    {
+        AACMP4::FdSink sink(fd);
+        AACMP4::DurableSink<AACMP4::FdSink> durable(sink, policy);
+        AACMP4::WriterConfig config;
+        config.chunk_policy = chunk_policy;
+        AACMP4::AacMp4Writer<decltype(durable)> writer(durable, sample_rate, frame_length, 2, config);
+        size_t offset = 0;
+        for(auto size : sizes) {
+            writer.add_frame(data.data() + offset, size);
+            offset += size;
+        }
+        writer.finalize();
+        durable.sync();
+        stats = durable.stats();
+    }
+    auto elapsed = chrono::duration_cast<chrono::microseconds>(chrono::steady_clock::now() - start);
+    ::close(fd);
+
+    printf("%-14s %10llu syncs %8llu us avg %8llu us max %10lld us\n", name,
+        static_cast<unsigned long long>(stats.syncs),
+        static_cast<unsigned long long>(stats.syncs > 0 ? stats.total_time_ns / stats.syncs / 1000 : 0),
+        static_cast<unsigned long long>(stats.max_time_ns / 1000),
+        static_cast<long long>(elapsed.count()));
+}
+#endif
+
+// The encoder thread fills a buffer per frame and queues a reference to it; the writer thread writes the frame
+// and frees the buffer. With a pool, the buffers are recycled instead of allocated.
+static void run_handoff(const char* name, AACMP4::FramePool* pool, size_t max_frame_size,
+                        const vector<uint32_t>& sizes, const vector<uint8_t>& data, uint32_t sample_rate, uint32_t frame_length)
+{
+    ofstream output_file("sink_benchmark_handoff.mp4", ios::binary);
+    auto adapter = AACMP4::StreamAdapter(output_file);
+    AACMP4::BufferedSink<decltype(adapter), 64 * 1024> buffered(adapter);
+    AACMP4::AacMp4Writer<decltype(buffered)> writer(buffered, sample_rate, frame_length, 2);
+    AACMP4::FrameQueue queue(256, sizeof(AACMP4::Segment));
+    atomic<bool> done{false};
+
+    auto start = chrono::steady_clock::now();
+    thread writer_thread([&]() {
+        auto write_frame = [&](const AACMP4::u8* slot, size_t) {
+            AACMP4::Segment frame;
+            memcpy(&frame, slot, sizeof(frame));
+            writer.add_frame(frame.data, frame.size);
+            if(pool != nullptr) pool->release(frame.data);
+            else delete[] frame.data;
+        };
+        while(!done.load(memory_order_acquire)) {
+            if(queue.consume(write_frame) == 0) this_thread::yield();
+        }
+        while(queue.consume(write_frame) > 0) {}
+    });
+    size_t offset = 0;
+    for(auto size : sizes) {
+        AACMP4::u8* buffer = nullptr;
+        while((buffer = pool != nullptr ? pool->acquire() : new AACMP4::u8[max_frame_size]) == nullptr) this_thread::yield();
+        memcpy(buffer, data.data() + offset, size);
+        offset += size;
+        const AACMP4::Segment frame = {buffer, size};
+        while(!queue.try_push(reinterpret_cast<const AACMP4::u8*>(&frame), sizeof(frame))) this_thread::yield();
+    }
+    done.store(true, memory_order_release);
+    writer_thread.join();
+    writer.finalize();
+    auto elapsed = chrono::duration_cast<chrono::microseconds>(chrono::steady_clock::now() - start);
+
+    if(pool != nullptr) {
+        const AACMP4::FramePoolStats stats = pool->stats();
+        printf("%-14s %10lld us, %zu of %zu buffers at most, %llu waits\n", name, static_cast<long long>(elapsed.count()),
+            stats.high_water_mark, stats.capacity, static_cast<unsigned long long>(stats.exhausted));
+    }
+    else {
+        printf("%-14s %10lld us\n", name, static_cast<long long>(elapsed.count()));
+    }
+}
+
+int main()
+{
+    // One hour of 48kHz AAC-LC at about 64kbps.
+    const uint32_t sample_rate = 48000;
+    const uint32_t frame_length = 1024;
+    const size_t number_of_frames = size_t(sample_rate) * 3600 / frame_length;
+
+    vector<AACMP4::u32> chunks;
+    vector<uint32_t> sizes;
+    vector<uint8_t> data;
+    chunks.reserve(number_of_frames);
+    sizes.reserve(number_of_frames);
+    for(size_t i = 0; i < number_of_frames; i++) {
+        uint32_t size = 150 + (i * 7919) % 100;
+        chunks.push_back(size);
+        sizes.push_back(size);
+        data.insert(data.end(), size, uint8_t(i));
+    }
+    const uint32_t number_of_samples = number_of_frames * frame_length;
+
+    run("per field", [&](auto& sink) {
+        PerFieldSink<remove_reference_t<decltype(sink)>> per_field(sink);
+        AACMP4::write_aac_mp4(per_field, chunks, data, sample_rate, number_of_samples, frame_length);
+    });
+    run("per field+buf", [&](auto& sink) {
+        AACMP4::BufferedSink<remove_reference_t<decltype(sink)>, 64 * 1024> buffered(sink);
+        PerFieldSink<decltype(buffered)> per_field(buffered);
+        AACMP4::write_aac_mp4(per_field, chunks, data, sample_rate, number_of_samples, frame_length);
+    });
+    run("unbuffered", [&](auto& sink) {
+        AACMP4::write_aac_mp4(sink, chunks, data, sample_rate, number_of_samples, frame_length);
+    });
+    run("buffered", [&](auto& sink) {
+        AACMP4::BufferedSink<remove_reference_t<decltype(sink)>, 64 * 1024> buffered(sink);
+        AACMP4::write_aac_mp4(buffered, chunks, data, sample_rate, number_of_samples, frame_length);
+    });
+    run("bulk sizes", [&](auto& sink) {
+        AACMP4::BufferedSink<remove_reference_t<decltype(sink)>, 64 * 1024> buffered(sink);
+        AACMP4::write_aac_mp4(buffered, sizes.data(), sizes.size(), data, sample_rate, number_of_samples, frame_length);
+    });
+
+    // Conversion of the sample size table alone.
+    for(int pass = 0; pass < 2; pass++) {
+        AACMP4::StszBox stsz;
+        auto start = chrono::steady_clock::now();
+        if(pass == 0) {
+            stsz.entries.reserve(sizes.size());
+            for(auto size : sizes) stsz.entries.push_back(size);
+        }
+        else {
+            stsz.append(sizes.data(), sizes.size());
+        }
+        auto elapsed = chrono::duration_cast<chrono::microseconds>(chrono::steady_clock::now() - start);
+        printf("%-14s %10zu entries     %10lld us\n", pass == 0 ? "stsz scalar" : "stsz bulk", stsz.entries.size(), static_cast<long long>(elapsed.count()));
+    }
+
+#ifdef AACMP4_HAS_FD_SINK
+    // One minute of frames, synced with each policy.
+    {
+        const size_t durable_frames = size_t(sample_rate) * 60 / frame_length;
+        const vector<uint32_t> durable_sizes(sizes.begin(), sizes.begin() + durable_frames);
+        AACMP4::ChunkPolicy no_chunks;
+        AACMP4::DurabilityPolicy policy;
+        policy.sync_bytes = 1;
+        run_durable("every frame", policy, no_chunks, durable_sizes, data, sample_rate, frame_length);
+        policy = AACMP4::DurabilityPolicy();
+        policy.sync_bytes = 64 * 1024;
+        policy.writeback_bytes = 16 * 1024;
+        run_durable("every 64KiB", policy, no_chunks, durable_sizes, data, sample_rate, frame_length);
+        policy = AACMP4::DurabilityPolicy();
+        policy.sync_interval_ms = 100;
+        run_durable("every 100ms", policy, no_chunks, durable_sizes, data, sample_rate, frame_length);
+        policy = AACMP4::DurabilityPolicy();
+        policy.sync_on_fragment = true;
+        AACMP4::ChunkPolicy one_second;
+        one_second.chunk_duration_ms = 1000;
+        run_durable("every chunk", policy, one_second, durable_sizes, data, sample_rate, frame_length);
+    }
+#endif
+
+    // Frame buffers of maxOutBufBytes (768 bytes per channel) handed over between threads.
+    {
+        const size_t max_frame_size = 768 * 2;
+        run_handoff("new/delete", nullptr, max_frame_size, sizes, data, sample_rate, frame_length);
+        AACMP4::FramePool pool(512, max_frame_size);
+        run_handoff("frame pool", &pool, max_frame_size, sizes, data, sample_rate, frame_length);
+    }
+
+    return 0;
+}
@@ -9,8 +9,12 @@
 #include <cstdint>
 #include <vector>
 #include <cstring>
+#include <type_traits>
+#include <utility>
 
 #include "primitive_types.hpp"
+#include "sample_sizes.hpp"
+#include "storage.hpp"
 
 namespace AACMP4 {
     template<typename T, std::size_t N>
@@ -59,9 +63,49 @@ namespace AACMP4 {
     typedef u24 Flags;
     typedef u32 Timestamp;
 
+    // Marks types whose in-memory image is exactly their serialized image,
+    // i.e. packed structs made only of u8 and the big-endian primitive types without variable-length members.
+    // Such values are written with a single stream.write() call instead of field by field.
+    template<typename T>
+    struct is_trivially_serializable : std::false_type {};
+    template<> struct is_trivially_serializable<u16> : std::true_type {};
+    template<> struct is_trivially_serializable<u24> : std::true_type {};
+    template<> struct is_trivially_serializable<u32> : std::true_type {};
+    template<> struct is_trivially_serializable<u64> : std::true_type {};
+    template<> struct is_trivially_serializable<BoxType> : std::true_type {};
+
     template<typename S, typename T>
     static void write(S& stream, const T& value) {
-        value.write(stream);
+        if constexpr (is_trivially_serializable<T>::value) {
+            static_assert(std::is_trivially_copyable<T>::value && alignof(T) == 1, "trivially serializable types must be packed byte images");
+            stream.write(reinterpret_cast<const u8*>(&value), sizeof(T));
+        }
+        else {
+            value.write(stream);
+        }
+    }
+
+    // Writes count values stored contiguously, with a single stream.write() call if possible.
+    template<typename S, typename T>
+    static void write_array(S& stream, const T* values, std::size_t count) {
+        if constexpr (is_trivially_serializable<T>::value) {
+            static_assert(std::is_trivially_copyable<T>::value && alignof(T) == 1, "trivially serializable types must be packed byte images");
+            stream.write(reinterpret_cast<const u8*>(values), sizeof(T) * count);
+        }
+        else {
+            for(std::size_t i = 0; i < count; i++) {
+                AACMP4::write(stream, values[i]);
+            }
+        }
+    }
+
+    // Reads a trivially serializable value from its serialized image. Returns false if size is too small.
+    template<typename T>
+    static bool read(const u8* data, std::size_t size, T& value) {
+        static_assert(is_trivially_serializable<T>::value, "only trivially serializable types can be read directly");
+        if(size < sizeof(T)) return false;
+        std::memcpy(&value, data, sizeof(T));
+        return true;
     }
 
     template<typename S, typename T>
@@ -74,6 +118,25 @@ namespace AACMP4 {
         stream.write(value.data(), value.size());
     }
 
+    // True if the stream can write a list of segments at once, like FdSink.
+    template<typename S, typename = void>
+    struct has_write_segments : std::false_type {};
+    template<typename S>
+    struct has_write_segments<S, decltype(std::declval<S&>().write_segments(std::declval<const Segment*>(), std::size_t()), void())> : std::true_type {};
+
+    // Writes the segments in order, with a single stream.write_segments() call if the stream supports it.
+    template<typename S>
+    static void write_segments(S& stream, const Segment* segments, std::size_t count) {
+        if constexpr (has_write_segments<S>::value) {
+            stream.write_segments(segments, count);
+        }
+        else {
+            for(std::size_t i = 0; i < count; i++) {
+                stream.write(segments[i].data, segments[i].size);
+            }
+        }
+    }
+
     template<typename S>
     static void write(S& stream, u8 value) {
         stream.write(&value, 1);
@@ -99,6 +162,29 @@ namespace AACMP4 {
         stream.write(value.octets, 4);
     }
 
+    // True if the stream can read back bytes already written with read_at(position, data, size).
+    template<typename S, typename = void>
+    struct has_read_at : std::false_type {};
+    template<typename S>
+    struct has_read_at<S, decltype(std::declval<S&>().read_at(std::size_t(), static_cast<u8*>(nullptr), std::size_t()), void())> : std::true_type {};
+
+    // True if the table is not contiguous in memory and provides for_each_block() instead of data().
+    template<typename C, typename = void>
+    struct has_for_each_block : std::false_type {};
+    template<typename C>
+    struct has_for_each_block<C, decltype(std::declval<const C&>().for_each_block(std::declval<void(*)(const typename C::value_type*, std::size_t)>()), void())> : std::true_type {};
+
+    // Calls f(values, count) for each contiguous block of the table, in order.
+    template<typename C, typename F>
+    static void for_each_block(const C& table, F&& f) {
+        if constexpr (has_for_each_block<C>::value) {
+            table.for_each_block(f);
+        }
+        else {
+            f(table.data(), table.size());
+        }
+    }
+
     struct __attribute__((packed)) AtomHeader {
         u32 size;
         BoxType type;
@@ -110,6 +196,7 @@ namespace AACMP4 {
             AACMP4::write(stream, this->type);
         }
     };
+    template<> struct is_trivially_serializable<AtomHeader> : std::true_type {};
 
     template<typename T>
     struct __attribute__((packed)) Matrix {
@@ -123,6 +210,7 @@ namespace AACMP4 {
             }
         }
     };
+    template<typename T> struct is_trivially_serializable<Matrix<T>> : is_trivially_serializable<T> {};
 
     template<typename T>
     static void default_compute(T& self) {
@@ -174,6 +262,7 @@ namespace AACMP4 {
             AACMP4::write(stream, this->next_track_id);
         }
     };
+    template<> struct is_trivially_serializable<MvhdAtom> : std::true_type {};
 
     struct __attribute__((packed)) TkhdAtom {
         AtomHeader header;
@@ -216,43 +305,57 @@ namespace AACMP4 {
             AACMP4::write(stream, this->height);
         }
     };
+    template<> struct is_trivially_serializable<TkhdAtom> : std::true_type {};
 
-    struct __attribute__((packed)) ElstAtom {
-        struct __attribute__((packed)) ElstEntry {
-            u32 segment_duration;
-            u32 media_time;
-            u32 media_rate;
+    struct __attribute__((packed)) ElstEntry {
+        u32 segment_duration;
+        u32 media_time;
+        u32 media_rate;
 
-            template<typename S> void write(S& stream) const {
-                AACMP4::write(stream, this->segment_duration);
-                AACMP4::write(stream, this->media_time);
-                AACMP4::write(stream, this->media_rate);
-            }
-        };
+        template<typename S> void write(S& stream) const {
+            AACMP4::write(stream, this->segment_duration);
+            AACMP4::write(stream, this->media_time);
+            AACMP4::write(stream, this->media_rate);
+        }
+    };
+    template<> struct is_trivially_serializable<ElstEntry> : std::true_type {};
 
+    // Edit list. The writers present the whole track with a single edit, while an edited file may have
+    // several, e.g. one per input of a concatenation.
+    template<typename Storage = HeapStorage>
+    struct BasicElstAtom {
+        using ElstEntry = AACMP4::ElstEntry;
         AtomHeader header;
         Version version;
         Flags flags;
         u32 entry_count;
-        ElstEntry entries[1];
+        typename Storage::template Container<ElstEntry, Table::EditEntries> entries;
 
         static constexpr const char* TYPE = "elst";
-        void compute(void) { default_compute(*this); }
+        void compute(void) {
+            this->entry_count = this->entries.size();
+            this->header.size = sizeof(this->header)
+                + sizeof(this->version)
+                + sizeof(this->flags)
+                + sizeof(this->entry_count)
+                + this->entry_count * sizeof(ElstEntry);
+            this->header.type = TYPE;
+        }
 
         template <typename S> void write(S& stream) const {
             AACMP4::write(stream, this->header);
             AACMP4::write(stream, this->version);
             AACMP4::write(stream, this->flags);
             AACMP4::write(stream, this->entry_count);
-            for(std::size_t i = 0; i < this->entry_count; i++) {
-                AACMP4::write(stream, this->entries[i]);
-            }
+            AACMP4::write_array(stream, this->entries.data(), this->entries.size());
         }
     };
+    using ElstAtom = BasicElstAtom<>;
 
-    struct __attribute__((packed)) EdtsBox {
+    template<typename Storage = HeapStorage>
+    struct BasicEdtsBox {
         AtomHeader header;
-        ElstAtom elst;
+        BasicElstAtom<Storage> elst;
 
         static constexpr const char* TYPE = "edts";
         void compute(void) {
@@ -266,6 +369,7 @@ namespace AACMP4 {
             AACMP4::write(stream, this->elst);
         }
     };
+    using EdtsBox = BasicEdtsBox<>;
 
     struct __attribute__((packed)) SttsAtom {
         struct __attribute__((packed)) SttsEntry {
@@ -298,32 +402,36 @@ namespace AACMP4 {
             AACMP4::write(stream, this->version);
             AACMP4::write(stream, this->flags);
             AACMP4::write(stream, this->number_of_entries);
-            for(std::size_t i = 0; i < this->number_of_entries; i++) {
-                AACMP4::write(stream, this->entries[i]);
-            }
+            AACMP4::write_array(stream, this->entries, this->number_of_entries);
         }
     };
+    template<> struct is_trivially_serializable<SttsAtom::SttsEntry> : std::true_type {};
 
-    struct __attribute__((packed)) StscAtom {
-        struct __attribute__((packed)) StscEntry {
-            u32 first_chunk;
-            u32 samples_per_chunk;
-            u32 sample_description_id;
+    struct __attribute__((packed)) StscEntry {
+        u32 first_chunk;
+        u32 samples_per_chunk;
+        u32 sample_description_id;
 
-            template<typename S> void write(S& stream) const {
-                AACMP4::write(stream, this->first_chunk);
-                AACMP4::write(stream, this->samples_per_chunk);
-                AACMP4::write(stream, this->sample_description_id);
-            }
-        };
+        template<typename S> void write(S& stream) const {
+            AACMP4::write(stream, this->first_chunk);
+            AACMP4::write(stream, this->samples_per_chunk);
+            AACMP4::write(stream, this->sample_description_id);
+        }
+    };
+    template<> struct is_trivially_serializable<StscEntry> : std::true_type {};
+
+    template<typename Storage = HeapStorage>
+    struct BasicStscAtom {
+        using StscEntry = AACMP4::StscEntry;
         AtomHeader header;
         Version version;
         Flags flags;
         u32 number_of_entries;
-        StscEntry entries[1];
+        typename Storage::template Container<StscEntry, Table::ChunkRuns> entries;
 
         static constexpr const char* TYPE = "stsc";
         void compute(void) {
+            this->number_of_entries = this->entries.size();
             this->header.size = sizeof(this->header)
                 + sizeof(this->version)
                 + sizeof(this->flags)
@@ -332,16 +440,29 @@ namespace AACMP4 {
             this->header.type = TYPE;
         }
 
+        // Appends a chunk holding the given number of samples. A new entry is added only when the count changes.
+        // Returns false if the entry does not fit in the storage.
+        bool add_chunk(std::uint32_t chunk_index, std::uint32_t samples_per_chunk) {
+            if(this->entries.empty() || this->entries.back().samples_per_chunk != samples_per_chunk) {
+                if(this->entries.size() == this->entries.max_size()) return false;
+                StscEntry entry;
+                entry.first_chunk = chunk_index;
+                entry.samples_per_chunk = samples_per_chunk;
+                entry.sample_description_id = 1;
+                this->entries.push_back(entry);
+            }
+            return true;
+        }
+
         template<typename S> void write(S& stream) const {
             AACMP4::write(stream, this->header);
             AACMP4::write(stream, this->version);
             AACMP4::write(stream, this->flags);
             AACMP4::write(stream, this->number_of_entries);
-            for(std::size_t i = 0; i < this->number_of_entries; i++) {
-                AACMP4::write(stream, this->entries[i]);
-            }
+            AACMP4::write_array(stream, this->entries.data(), this->entries.size());
         }
     };
+    using StscAtom = BasicStscAtom<>;
 
     struct __attribute__((packed)) StszAtomHeader {
         AtomHeader header;
@@ -358,37 +479,141 @@ namespace AACMP4 {
             AACMP4::write(stream, this->number_of_entries);
         }
     };
+    template<> struct is_trivially_serializable<StszAtomHeader> : std::true_type {};
 
-    struct StszBox {
+    // Sample size atom.
+    // Written without entries when all samples have the same size.
+    // If compact is set, written as stz2 with 8 or 16 bit entries when every sample fits.
+    template<typename Storage = HeapStorage>
+    struct BasicStszBox {
         static constexpr const char* TYPE = "stsz";
+        static constexpr const char* TYPE_COMPACT = "stz2";
         StszAtomHeader header;
-        std::vector<u32> entries;
+        typename Storage::template Container<u32, Table::SampleSizes> entries;
+        bool compact = false;
+        std::uint8_t field_size = 32;   // 0 if the sample_size field is used.
+
+        // Appends native frame sizes, converting them in bulk. Returns the summary of the appended sizes.
+        // Only the sizes which fit in the storage are appended.
+        template<typename T>
+        SampleSizeStats append(const T* sizes, std::size_t count) {
+            const std::size_t offset = this->entries.size();
+            count = count < this->entries.max_size() - offset ? count : this->entries.max_size() - offset;
+            if constexpr (has_for_each_block<decltype(this->entries)>::value) {
+                // Not contiguous. Convert through a small buffer.
+                SampleSizeStats stats;
+                u32 buffer[256];
+                for(std::size_t i = 0; i < count; i += sizeof(buffer) / sizeof(buffer[0])) {
+                    const std::size_t block = count - i < sizeof(buffer) / sizeof(buffer[0]) ? count - i : sizeof(buffer) / sizeof(buffer[0]);
+                    stats.merge(encode_sample_sizes(buffer, sizes + i, block));
+                    this->entries.append(buffer, block);
+                }
+                return stats;
+            }
+            else {
+                this->entries.resize(offset + count);
+                return encode_sample_sizes(this->entries.data() + offset, sizes, count);
+            }
+        }
 
         void compute(void) {
-            this->header.header.size = sizeof(this->header) + entries.size() * 4;
-            this->header.header.type = TYPE;
+            std::uint32_t first = 0;
+            std::uint32_t max = 0;
+            bool constant = !this->entries.empty();
+            bool has_first = false;
+            for_each_block(this->entries, [&](const u32* values, std::size_t count) {
+                if(count > 0 && !has_first) {
+                    first = values[0];
+                    has_first = true;
+                }
+                for(std::size_t i = 0; i < count; i++) {
+                    const std::uint32_t value = values[i];
+                    constant = constant && value == first;
+                    max = value > max ? value : max;
+                }
+            });
+
             this->header.number_of_entries = entries.size();
+            if(constant) {
+                this->field_size = 0;
+                this->header.header.type = TYPE;
+                this->header.sample_size = first;
+                this->header.header.size = sizeof(this->header);
+                return;
+            }
+            this->field_size = !this->compact || max > 0xffff ? 32 : max > 0xff ? 16 : 8;
+            if(this->field_size == 32) {
+                this->header.header.type = TYPE;
+                this->header.sample_size = 0;
+            }
+            else {
+                // stz2 has 24 reserved bits and the field size in place of sample_size.
+                this->header.header.type = TYPE_COMPACT;
+                this->header.sample_size = this->field_size;
+            }
+            this->header.header.size = sizeof(this->header) + entries.size() * (this->field_size / 8);
         }
 
         template<typename S> void write(S& stream) const {
             AACMP4::write(stream, this->header);
-            for(std::size_t i = 0; i < this->entries.size(); i++) {
-                AACMP4::write(stream, this->entries[i]);
+            if(this->field_size == 0) {
+                return;
+            }
+            if(this->field_size == 32) {
+                for_each_block(this->entries, [&](const u32* values, std::size_t count) {
+                    AACMP4::write_array(stream, values, count);
+                });
+                return;
+            }
+            // Narrow the entries through a small buffer.
+            const std::size_t bytes_per_entry = this->field_size / 8;
+            u8 buffer[256];
+            std::size_t buffered = 0;
+            for_each_block(this->entries, [&](const u32* values, std::size_t count) {
+                for(std::size_t i = 0; i < count; i++) {
+                    const std::uint32_t value = values[i];
+                    if(bytes_per_entry == 2) {
+                        buffer[buffered++] = std::uint8_t(value >> 8);
+                    }
+                    buffer[buffered++] = std::uint8_t(value);
+                    if(buffered == sizeof(buffer)) {
+                        AACMP4::write(stream, buffer, buffered);
+                        buffered = 0;
+                    }
+                }
+            });
+            if(buffered > 0) {
+                AACMP4::write(stream, buffer, buffered);
             }
         }
     };
+    using StszBox = BasicStszBox<>;
 
-    struct StcoAtom {
+    // Chunk offset atom. Promoted to co64 when any offset does not fit in 32 bits.
+    template<typename Storage = HeapStorage>
+    struct BasicStcoAtom {
         static constexpr const char* TYPE = "stco";
+        static constexpr const char* TYPE_64 = "co64";
         AtomHeader header;
         Version version;
         Flags flags;
         u32 number_of_entries;
-        u32 entries[1];
+        typename Storage::template Container<std::uint64_t, Table::ChunkOffsets> entries;
+
+        bool is_64bit(void) const { return this->header.type == BoxType(TYPE_64); }
 
         void compute(void) {
-            default_compute(*this);
-            this->number_of_entries = 1;
+            bool large = false;
+            for(auto offset : this->entries) {
+                large = large || offset > 0xffffffffu;
+            }
+            this->number_of_entries = this->entries.size();
+            this->header.size = sizeof(this->header)
+                + sizeof(this->version)
+                + sizeof(this->flags)
+                + sizeof(this->number_of_entries)
+                + this->number_of_entries * (large ? sizeof(u64) : sizeof(u32));
+            this->header.type = large ? TYPE_64 : TYPE;
         }
 
         template<typename S> void write(S& stream) const {
@@ -396,10 +621,21 @@ namespace AACMP4 {
             AACMP4::write(stream, this->version);
             AACMP4::write(stream, this->flags);
             AACMP4::write(stream, this->number_of_entries);
-            AACMP4::write(stream, this->entries[0]);
+            const bool large = this->is_64bit();
+            for(auto offset : this->entries) {
+                if(large) {
+                    AACMP4::write(stream, u64(offset));
+                }
+                else {
+                    AACMP4::write(stream, u32(std::uint32_t(offset)));
+                }
+            }
         }
     };
+    using StcoAtom = BasicStcoAtom<>;
 
+    // Media header. The duration is in the media timescale, i.e. in samples, and wraps a 32-bit field
+    // after about 24.8 hours at 48kHz. compute() selects version 1 with 64-bit times for such durations.
     struct __attribute__((packed)) MdhdAtom {
         AtomHeader header;
         Version version;
@@ -407,21 +643,34 @@ namespace AACMP4 {
         u32 creation_time;
         u32 modification_time;
         u32 timescale;
-        u32 duration;
+        u64 duration;
         u16 language;
         u16 quality;
 
         static constexpr const char* TYPE = "mdhd";
-        void compute(void) { default_compute(*this); }
+        void compute(void) {
+            this->version = std::uint64_t(this->duration) > 0xffffffffu ? 1 : 0;
+            // The struct holds 32-bit times and a 64-bit duration. Version 1 widens the times, version 0 narrows the duration.
+            this->header.size = this->version == 1 ? sizeof(*this) + 2 * sizeof(u32) : sizeof(*this) - sizeof(u32);
+            this->header.type = TYPE;
+        }
 
         template<typename S> void write(S& stream) const {
             AACMP4::write(stream, this->header);
             AACMP4::write(stream, this->version);
             AACMP4::write(stream, this->flags);
-            AACMP4::write(stream, this->creation_time);
-            AACMP4::write(stream, this->modification_time);
-            AACMP4::write(stream, this->timescale);
-            AACMP4::write(stream, this->duration);
+            if(this->version == 1) {
+                AACMP4::write(stream, u64(this->creation_time));
+                AACMP4::write(stream, u64(this->modification_time));
+                AACMP4::write(stream, this->timescale);
+                AACMP4::write(stream, this->duration);
+            }
+            else {
+                AACMP4::write(stream, this->creation_time);
+                AACMP4::write(stream, this->modification_time);
+                AACMP4::write(stream, this->timescale);
+                AACMP4::write(stream, u32(std::uint32_t(this->duration)));
+            }
             AACMP4::write(stream, this->language);
             AACMP4::write(stream, this->quality);
         }
@@ -451,6 +700,7 @@ namespace AACMP4 {
             AACMP4::write(stream, this->name, sizeof(this->name));
         }
     };
+    template<> struct is_trivially_serializable<HdlrAtom> : std::true_type {};
     
     struct __attribute__((packed)) SmhdAtom {
         AtomHeader header;
@@ -464,6 +714,7 @@ namespace AACMP4 {
             AACMP4::write(stream, this->reserved, sizeof(this->reserved));
         }
     };
+    template<> struct is_trivially_serializable<SmhdAtom> : std::true_type {};
 
     struct __attribute__((packed)) DrefBox {
         struct __attribute__((packed)) DataEntry {
@@ -505,6 +756,7 @@ namespace AACMP4 {
             }
         }
     };
+    template<> struct is_trivially_serializable<DrefBox::DataEntry> : std::true_type {};
 
 
     struct __attribute__((packed)) DinfBox {
@@ -604,6 +856,7 @@ namespace AACMP4 {
             AACMP4::write(stream, this->desc);
         }
     };
+    template<> struct is_trivially_serializable<EsdsAtom> : std::true_type {};
 
     struct __attribute__((packed)) BtrtAtom {
         AtomHeader header;
@@ -621,72 +874,83 @@ namespace AACMP4 {
             AACMP4::write(stream, this->average_bit_rate);
         }
     };
+    template<> struct is_trivially_serializable<BtrtAtom> : std::true_type {};
 
-    struct StsdBox {
-        // Sound Description V0
-        // https://developer.apple.com/documentation/quicktime-file-format/sound_sample_description_version_0
-        struct __attribute__((packed)) SampleDescriptionEntryHeader {
-            AtomHeader header;
-            u8 reserved[6];
-            u16 data_reference_index;
-            u16 version;
-            u16 revision_level;
-            u32 vendor;
-            u16 number_of_channels;
-            u16 sample_size;
-            u16 compression_id;
-            u16 packet_size;
-            u32 sample_rate;
+    // Sound Description V0
+    // https://developer.apple.com/documentation/quicktime-file-format/sound_sample_description_version_0
+    struct __attribute__((packed)) SampleDescriptionEntryHeader {
+        AtomHeader header;
+        u8 reserved[6];
+        u16 data_reference_index;
+        u16 version;
+        u16 revision_level;
+        u32 vendor;
+        u16 number_of_channels;
+        u16 sample_size;
+        u16 compression_id;
+        u16 packet_size;
+        u32 sample_rate;
 
-            template<typename S> void write(S& stream) const {
-                AACMP4::write(stream, this->header);
-                AACMP4::write(stream, this->reserved, sizeof(this->reserved));
-                AACMP4::write(stream, this->data_reference_index);
-                AACMP4::write(stream, this->version);
-                AACMP4::write(stream, this->revision_level);
-                AACMP4::write(stream, this->vendor);
-                AACMP4::write(stream, this->number_of_channels);
-                AACMP4::write(stream, this->sample_size);
-                AACMP4::write(stream, this->compression_id);
-                AACMP4::write(stream, this->packet_size);
-                AACMP4::write(stream, this->sample_rate);
-            }
-        };
-        struct __attribute__((packed)) SampleDescriptionEntry {
-            SampleDescriptionEntryHeader header;
-            EsdsAtom esds;
-            BtrtAtom btrt;
+        template<typename S> void write(S& stream) const {
+            AACMP4::write(stream, this->header);
+            AACMP4::write(stream, this->reserved, sizeof(this->reserved));
+            AACMP4::write(stream, this->data_reference_index);
+            AACMP4::write(stream, this->version);
+            AACMP4::write(stream, this->revision_level);
+            AACMP4::write(stream, this->vendor);
+            AACMP4::write(stream, this->number_of_channels);
+            AACMP4::write(stream, this->sample_size);
+            AACMP4::write(stream, this->compression_id);
+            AACMP4::write(stream, this->packet_size);
+            AACMP4::write(stream, this->sample_rate);
+        }
+    };
+    template<> struct is_trivially_serializable<SampleDescriptionEntryHeader> : std::true_type {};
 
-            static constexpr const char* TYPE = "mp4a";
-            void compute(void) { 
-                this->esds.compute();
-                this->btrt.compute();
-                this->header.header.size = sizeof(this->header) + this->esds.header.size + this->btrt.header.size;
-                this->header.header.type = TYPE;
-                std::fill(this->header.reserved, this->header.reserved + sizeof(this->header.reserved), 0);
-            }
+    struct __attribute__((packed)) SampleDescriptionEntry {
+        SampleDescriptionEntryHeader header;
+        EsdsAtom esds;
+        BtrtAtom btrt;
 
-            template<typename S> void write(S& stream) const {
-                AACMP4::write(stream, this->header);
-                AACMP4::write(stream, this->esds);
-                AACMP4::write(stream, this->btrt);
-            }
-        };
-        struct __attribute__((packed)) StsdHeader {
-            AtomHeader header;
-            Version version;
-            Flags flags;
-            u32 entry_count;
+        static constexpr const char* TYPE = "mp4a";
+        void compute(void) { 
+            this->esds.compute();
+            this->btrt.compute();
+            this->header.header.size = sizeof(this->header) + this->esds.header.size + this->btrt.header.size;
+            this->header.header.type = TYPE;
+            std::fill(this->header.reserved, this->header.reserved + sizeof(this->header.reserved), 0);
+        }
 
-            template<typename S> void write(S& stream) const {
-                AACMP4::write(stream, this->header);
-                AACMP4::write(stream, this->version);
-                AACMP4::write(stream, this->flags);
-                AACMP4::write(stream, this->entry_count);
-            }
-        };
+        template<typename S> void write(S& stream) const {
+            AACMP4::write(stream, this->header);
+            AACMP4::write(stream, this->esds);
+            AACMP4::write(stream, this->btrt);
+        }
+    };
+    template<> struct is_trivially_serializable<SampleDescriptionEntry> : std::true_type {};
+
+    struct __attribute__((packed)) StsdHeader {
+        AtomHeader header;
+        Version version;
+        Flags flags;
+        u32 entry_count;
+
+        template<typename S> void write(S& stream) const {
+            AACMP4::write(stream, this->header);
+            AACMP4::write(stream, this->version);
+            AACMP4::write(stream, this->flags);
+            AACMP4::write(stream, this->entry_count);
+        }
+    };
+    template<> struct is_trivially_serializable<StsdHeader> : std::true_type {};
+
+    template<typename Storage = HeapStorage>
+    struct BasicStsdBox {
+        using SampleDescriptionEntryHeader = AACMP4::SampleDescriptionEntryHeader;
+        using SampleDescriptionEntry = AACMP4::SampleDescriptionEntry;
+        using StsdHeader = AACMP4::StsdHeader;
         StsdHeader header;
-        std::vector<SampleDescriptionEntry> sample_description_entries;
+        typename Storage::template Container<SampleDescriptionEntry, Table::SampleDescriptions> sample_description_entries;
 
         static constexpr const char* TYPE = "stsd";
         void compute(void) {
@@ -707,14 +971,16 @@ namespace AACMP4 {
             }
         }
     };
+    using StsdBox = BasicStsdBox<>;
 
-    struct StblBox {
+    template<typename Storage = HeapStorage>
+    struct BasicStblBox {
         AtomHeader header;
-        StsdBox stsd;
+        BasicStsdBox<Storage> stsd;
         SttsAtom stts;
-        StscAtom stsc;
-        StszBox stsz;
-        StcoAtom stco;
+        BasicStscAtom<Storage> stsc;
+        BasicStszBox<Storage> stsz;
+        BasicStcoAtom<Storage> stco;
 
         static constexpr const char* TYPE = "stbl";
         void compute(void) { 
@@ -741,12 +1007,14 @@ namespace AACMP4 {
             AACMP4::write(stream, this->stco);
         }
     };
+    using StblBox = BasicStblBox<>;
 
-    struct MinfBox {
+    template<typename Storage = HeapStorage>
+    struct BasicMinfBox {
         AtomHeader header;
         SmhdAtom smhd;
         DinfBox dinf;
-        StblBox stbl;
+        BasicStblBox<Storage> stbl;
 
         static constexpr const char* TYPE = "minf";
         void compute(void) {
@@ -764,12 +1032,14 @@ namespace AACMP4 {
             AACMP4::write(stream, this->stbl);
         }
     };
+    using MinfBox = BasicMinfBox<>;
 
-    struct MdiaBox {
+    template<typename Storage = HeapStorage>
+    struct BasicMdiaBox {
         AtomHeader header;
         MdhdAtom mdhd;
         HdlrAtom hdlr;
-        MinfBox minf;
+        BasicMinfBox<Storage> minf;
 
         static constexpr const char* TYPE = "mdia";
         void compute(void) {
@@ -790,12 +1060,14 @@ namespace AACMP4 {
             AACMP4::write(stream, this->minf);
         }
     };
+    using MdiaBox = BasicMdiaBox<>;
 
-    struct TrakBox {
+    template<typename Storage = HeapStorage>
+    struct BasicTrakBox {
         AtomHeader header;
         TkhdAtom tkhd;
-        EdtsBox edts;
-        MdiaBox mdia;
+        BasicEdtsBox<Storage> edts;
+        BasicMdiaBox<Storage> mdia;
 
         static constexpr const char* TYPE = "trak";
         void compute(void) {
@@ -816,11 +1088,59 @@ namespace AACMP4 {
             AACMP4::write(stream, this->mdia);
         }
     };
+    using TrakBox = BasicTrakBox<>;
 
-    struct MoovBox {
+    struct __attribute__((packed)) TrexAtom {
+        AtomHeader header;
+        Version version;
+        Flags flags;
+        u32 track_id;
+        u32 default_sample_description_index;
+        u32 default_sample_duration;
+        u32 default_sample_size;
+        u32 default_sample_flags;
+
+        static constexpr const char* TYPE = "trex";
+        void compute(void) { default_compute(*this); }
+
+        template<typename S> void write(S& stream) const {
+            AACMP4::write(stream, this->header);
+            AACMP4::write(stream, this->version);
+            AACMP4::write(stream, this->flags);
+            AACMP4::write(stream, this->track_id);
+            AACMP4::write(stream, this->default_sample_description_index);
+            AACMP4::write(stream, this->default_sample_duration);
+            AACMP4::write(stream, this->default_sample_size);
+            AACMP4::write(stream, this->default_sample_flags);
+        }
+    };
+    template<> struct is_trivially_serializable<TrexAtom> : std::true_type {};
+
+    struct __attribute__((packed)) MvexBox {
+        AtomHeader header;
+        TrexAtom trex;
+
+        static constexpr const char* TYPE = "mvex";
+        void compute(void) {
+            this->trex.compute();
+            this->header.size = sizeof(this->header) + this->trex.header.size;
+            this->header.type = TYPE;
+        }
+
+        template<typename S> void write(S& stream) const {
+            AACMP4::write(stream, this->header);
+            AACMP4::write(stream, this->trex);
+        }
+    };
+    template<> struct is_trivially_serializable<MvexBox> : std::true_type {};
+
+    template<typename Storage = HeapStorage>
+    struct BasicMoovBox {
         AtomHeader header;
         MvhdAtom mvhd;
-        TrakBox trak;
+        BasicTrakBox<Storage> trak;
+        MvexBox mvex;
+        bool fragmented = false;    // Write mvex to declare movie fragments
 
         static constexpr const char* TYPE = "moov";
         void compute(void) {
@@ -829,6 +1149,10 @@ namespace AACMP4 {
             this->header.size = sizeof(this->header) 
                 + this->mvhd.header.size 
                 + this->trak.header.size;
+            if(this->fragmented) {
+                this->mvex.compute();
+                this->header.size = this->header.size + this->mvex.header.size;
+            }
             this->header.type = TYPE;
         }
 
@@ -836,28 +1160,239 @@ namespace AACMP4 {
             AACMP4::write(stream, this->header);
             AACMP4::write(stream, this->mvhd);
             AACMP4::write(stream, this->trak);
+            if(this->fragmented) {
+                AACMP4::write(stream, this->mvex);
+            }
         }
     };
+    using MoovBox = BasicMoovBox<>;
 
-    struct RefMdatBox {
+    struct __attribute__((packed)) MfhdAtom {
+        AtomHeader header;
+        Version version;
+        Flags flags;
+        u32 sequence_number;
+
+        static constexpr const char* TYPE = "mfhd";
+        void compute(void) { default_compute(*this); }
+
+        template<typename S> void write(S& stream) const {
+            AACMP4::write(stream, this->header);
+            AACMP4::write(stream, this->version);
+            AACMP4::write(stream, this->flags);
+            AACMP4::write(stream, this->sequence_number);
+        }
+    };
+    template<> struct is_trivially_serializable<MfhdAtom> : std::true_type {};
+
+    // Track fragment header with the default-base-is-moof and default-sample-duration-present flags set.
+    struct __attribute__((packed)) TfhdAtom {
+        static constexpr std::uint32_t FLAG_DEFAULT_SAMPLE_DURATION_PRESENT = 0x000008;
+        static constexpr std::uint32_t FLAG_DEFAULT_BASE_IS_MOOF = 0x020000;
+
+        AtomHeader header;
+        Version version;
+        Flags flags;
+        u32 track_id;
+        u32 default_sample_duration;
+
+        static constexpr const char* TYPE = "tfhd";
+        void compute(void) {
+            default_compute(*this);
+            this->flags = FLAG_DEFAULT_BASE_IS_MOOF | FLAG_DEFAULT_SAMPLE_DURATION_PRESENT;
+        }
+
+        template<typename S> void write(S& stream) const {
+            AACMP4::write(stream, this->header);
+            AACMP4::write(stream, this->version);
+            AACMP4::write(stream, this->flags);
+            AACMP4::write(stream, this->track_id);
+            AACMP4::write(stream, this->default_sample_duration);
+        }
+    };
+    template<> struct is_trivially_serializable<TfhdAtom> : std::true_type {};
+
+    struct __attribute__((packed)) TfdtAtom {
+        AtomHeader header;
+        Version version;
+        Flags flags;
+        u64 base_media_decode_time;
+
+        static constexpr const char* TYPE = "tfdt";
+        void compute(void) {
+            default_compute(*this);
+            this->version = 1;
+        }
+
+        template<typename S> void write(S& stream) const {
+            AACMP4::write(stream, this->header);
+            AACMP4::write(stream, this->version);
+            AACMP4::write(stream, this->flags);
+            AACMP4::write(stream, this->base_media_decode_time);
+        }
+    };
+    template<> struct is_trivially_serializable<TfdtAtom> : std::true_type {};
+
+    // Track fragment run header with the data-offset-present and sample-size-present flags set.
+    struct __attribute__((packed)) TrunAtomHeader {
+        static constexpr std::uint32_t FLAG_DATA_OFFSET_PRESENT = 0x000001;
+        static constexpr std::uint32_t FLAG_SAMPLE_SIZE_PRESENT = 0x000200;
+
+        AtomHeader header;
+        Version version;
+        Flags flags;
+        u32 sample_count;
+        u32 data_offset;
+
+        template<typename S> void write(S& stream) const {
+            AACMP4::write(stream, this->header);
+            AACMP4::write(stream, this->version);
+            AACMP4::write(stream, this->flags);
+            AACMP4::write(stream, this->sample_count);
+            AACMP4::write(stream, this->data_offset);
+        }
+    };
+    template<> struct is_trivially_serializable<TrunAtomHeader> : std::true_type {};
+
+    template<typename Storage = HeapStorage>
+    struct BasicTrunBox {
+        static constexpr const char* TYPE = "trun";
+        TrunAtomHeader header;
+        typename Storage::template Container<u32, Table::FragmentSamples> entries;
+
+        void compute(void) {
+            this->header.header.size = sizeof(this->header) + entries.size() * 4;
+            this->header.header.type = TYPE;
+            this->header.flags = TrunAtomHeader::FLAG_DATA_OFFSET_PRESENT | TrunAtomHeader::FLAG_SAMPLE_SIZE_PRESENT;
+            this->header.sample_count = entries.size();
+        }
+
+        template<typename S> void write(S& stream) const {
+            AACMP4::write(stream, this->header);
+            AACMP4::write_array(stream, this->entries.data(), this->entries.size());
+        }
+    };
+    using TrunBox = BasicTrunBox<>;
+
+    template<typename Storage = HeapStorage>
+    struct BasicTrafBox {
         AtomHeader header;
-        const std::vector<u8>& data;
+        TfhdAtom tfhd;
+        TfdtAtom tfdt;
+        BasicTrunBox<Storage> trun;
 
-        RefMdatBox(const std::vector<u8>& data) : data(data) {}
+        static constexpr const char* TYPE = "traf";
+        void compute(void) {
+            this->tfhd.compute();
+            this->tfdt.compute();
+            this->trun.compute();
+            this->header.size = sizeof(this->header)
+                + this->tfhd.header.size
+                + this->tfdt.header.size
+                + this->trun.header.header.size;
+            this->header.type = TYPE;
+        }
+
+        template<typename S> void write(S& stream) const {
+            AACMP4::write(stream, this->header);
+            AACMP4::write(stream, this->tfhd);
+            AACMP4::write(stream, this->tfdt);
+            AACMP4::write(stream, this->trun);
+        }
+    };
+    using TrafBox = BasicTrafBox<>;
+
+    template<typename Storage = HeapStorage>
+    struct BasicMoofBox {
+        AtomHeader header;
+        MfhdAtom mfhd;
+        BasicTrafBox<Storage> traf;
+
+        static constexpr const char* TYPE = "moof";
+        void compute(void) {
+            this->mfhd.compute();
+            this->traf.compute();
+            this->header.size = sizeof(this->header)
+                + this->mfhd.header.size
+                + this->traf.header.size;
+            this->header.type = TYPE;
+        }
+
+        template<typename S> void write(S& stream) const {
+            AACMP4::write(stream, this->header);
+            AACMP4::write(stream, this->mfhd);
+            AACMP4::write(stream, this->traf);
+        }
+    };
+    using MoofBox = BasicMoofBox<>;
+
+    // mdat box referring to a payload held by the caller, either in one vector or in a list of segments
+    // such as the blocks of a SegmentBuffer. The payload is written without being copied into one buffer.
+    struct RefMdatBox {
+        AtomHeader header;
+        u64 largesize;
+        const Segment* segments;
+        std::size_t number_of_segments;
+        std::uint64_t payload_size = 0;
+        Segment single;
+
+        RefMdatBox(const std::vector<u8>& data) : segments(nullptr), number_of_segments(1), payload_size(data.size()), single{data.data(), data.size()} {}
+        RefMdatBox(const Segment* segments, std::size_t number_of_segments) : segments(segments), number_of_segments(number_of_segments), single{nullptr, 0} {
+            for(std::size_t i = 0; i < number_of_segments; i++) {
+                this->payload_size += segments[i].size;
+            }
+        }
 
         static constexpr const char* TYPE = "mdat";
+        // Fills the mdat header for the payload size, using the 64-bit largesize field if required.
+        static void compute_header(AtomHeader& header, u64& largesize, std::uint64_t payload_size) {
+            header.type = TYPE;
+            if(sizeof(header) + payload_size > 0xffffffffu) {
+                header.size = 1;
+                largesize = sizeof(header) + sizeof(largesize) + payload_size;
+            }
+            else {
+                header.size = std::uint32_t(sizeof(header) + payload_size);
+            }
+        }
+        void compute(void) {
+            compute_header(this->header, this->largesize, this->payload_size);
+        }
+        bool is_large(void) const { return this->header.size == 1; }
+        std::size_t header_size(void) const { return sizeof(this->header) + (this->is_large() ? sizeof(this->largesize) : 0); }
+
+        template<typename S> void write(S& stream) const {
+            AACMP4::write(stream, this->header);
+            if(this->is_large()) {
+                AACMP4::write(stream, this->largesize);
+            }
+            AACMP4::write_segments(stream, this->segments != nullptr ? this->segments : &this->single, this->number_of_segments);
+        }
+    };
+
+    // Free space box. The padding is written as zeros.
+    struct FreeBox {
+        AtomHeader header;
+        std::uint32_t padding = 0;
+
+        static constexpr const char* TYPE = "free";
         void compute(void) {
-            this->header.size = sizeof(this->header) + this->data.size();
+            this->header.size = sizeof(this->header) + this->padding;
             this->header.type = TYPE;
         }
 
         template<typename S> void write(S& stream) const {
+            static constexpr u8 zeros[256] = {0};
             AACMP4::write(stream, this->header);
-            AACMP4::write(stream, this->data);
+            for(std::size_t remaining = this->padding; remaining > 0; ) {
+                std::size_t bytes_to_write = remaining < sizeof(zeros) ? remaining : sizeof(zeros);
+                AACMP4::write(stream, zeros, bytes_to_write);
+                remaining -= bytes_to_write;
+            }
         }
     };
 
-    struct FtypAtom {
+    struct __attribute__((packed)) FtypAtom {
         AtomHeader header;
         BoxType major_brand;
         u32 minor_version;
@@ -874,6 +1409,7 @@ namespace AACMP4 {
             AACMP4::write(stream, this->compatible_brands[1]);
         }
     };
+    template<> struct is_trivially_serializable<FtypAtom> : std::true_type {};
 
     struct DummyWriter {
         std::size_t bytes_written = 0;
@@ -882,91 +1418,120 @@ namespace AACMP4 {
         }
     };
 
-    template<typename S>
-    static void write_aac_mp4(S& stream, const std::vector<u32>& chunks, const std::vector<u8>& data, std::uint32_t sample_rate, std::uint32_t number_of_samples, std::uint32_t max_samples_per_chunk) {
-        FtypAtom ftyp;
+    // Sampling frequencies by the index used in AudioSpecificConfig and ADTS.
+    static constexpr std::uint32_t SAMPLE_RATES[] = {96000, 88200, 64000, 48000, 44100, 32000, 24000, 22050, 16000, 12000, 11025, 8000, 7350};
+    static constexpr std::uint8_t NUMBER_OF_SAMPLE_RATES = sizeof(SAMPLE_RATES) / sizeof(SAMPLE_RATES[0]);
+
+    // Builds the 5-byte AudioSpecificConfig from its fields.
+    // The trailing sync extension explicitly signals that SBR is not present.
+    static void make_audio_specific_config(u8 (&config)[5], std::uint8_t object_type, std::uint8_t frequency_index, std::uint8_t channel_configuration) {
+        config[0] = u8((object_type << 3) | (frequency_index >> 1));
+        config[1] = u8(((frequency_index & 1) << 7) | ((channel_configuration & 0x0f) << 3));
+        config[2] = 0x56;   // sync extension type 0x2b7
+        config[3] = 0xe5;   // extension object type SBR, sbr present flag 0
+        config[4] = 0x00;
+    }
+
+    // Builds the 5-byte AudioSpecificConfig of an AAC-LC stream.
+    static void make_audio_specific_config(u8 (&config)[5], std::uint32_t sample_rate, std::uint16_t number_of_channels) {
+        std::uint8_t frequency_index = 0;
+        while(frequency_index < NUMBER_OF_SAMPLE_RATES - 1 && SAMPLE_RATES[frequency_index] > sample_rate) {
+            frequency_index++;
+        }
+        const std::uint8_t object_type = 2;    // AAC LC
+        make_audio_specific_config(config, object_type, frequency_index, std::uint8_t(number_of_channels));
+    }
+
+    static void setup_ftyp(FtypAtom& ftyp) {
         ftyp.major_brand = "isom";
         ftyp.minor_version = 0x00000200;
         ftyp.compatible_brands[0] = "isom";
         ftyp.compatible_brands[1] = "mp41";
         ftyp.compute();
-        write(stream, ftyp);
+    }
 
-        MoovBox moov;
-        // mvhd
-        moov.mvhd.version = 0;
-        moov.mvhd.flags = 0;
-        moov.mvhd.creation_time = 0;
-        moov.mvhd.modification_time = 0;
-        moov.mvhd.timescale = 1000;
-        moov.mvhd.duration = number_of_samples * 1000 / sample_rate;
-        moov.mvhd.rate = 0x00010000;
-        moov.mvhd.volume = 0x0100;
-        std::fill(moov.mvhd.reserved, moov.mvhd.reserved + sizeof(moov.mvhd.reserved), 0);
-        moov.mvhd.matrix = Matrix<u32>();
-        moov.mvhd.preview_time = 0;
-        moov.mvhd.preview_duration = 0;
-        moov.mvhd.poster_time = 0;
-        moov.mvhd.selection_time = 0;
-        moov.mvhd.selection_duration = 0;
-        moov.mvhd.current_time = 0;
-        moov.mvhd.next_track_id = 2;
-
-        // trak/tkhd
-        moov.trak.tkhd.version = 0;
-        moov.trak.tkhd.flags = 0x0003;
-        moov.trak.tkhd.creation_time = 0;
-        moov.trak.tkhd.modification_time = 0;
-        moov.trak.tkhd.track_id = 1;
-        moov.trak.tkhd.reserved_0 = 0;
-        moov.trak.tkhd.duration = number_of_samples * 1000 / sample_rate;
-        std::fill(moov.trak.tkhd.reserved_1, moov.trak.tkhd.reserved_1 + sizeof(moov.trak.tkhd.reserved_1), 0);
-        moov.trak.tkhd.layer = 0;
-        moov.trak.tkhd.alternate_group = 1;
-        moov.trak.tkhd.volume = 0x0100;
-        moov.trak.tkhd.reserved_2 = 0;
-        moov.trak.tkhd.matrix = Matrix<u32>();
-        moov.trak.tkhd.width = 0;
-        moov.trak.tkhd.height = 0;
-        // trak/edts/elst
-        moov.trak.edts.elst.version = 0;
-        moov.trak.edts.elst.flags = 0;
-        moov.trak.edts.elst.entry_count = 1;
-        moov.trak.edts.elst.entries[0].segment_duration = number_of_samples * 1000 / sample_rate;
-        moov.trak.edts.elst.entries[0].media_time = 0x00000800;
-        moov.trak.edts.elst.entries[0].media_rate = 0x00010000;
-
-        // trak/mdia/mdhd
-        moov.trak.mdia.mdhd.version = 0;
-        moov.trak.mdia.mdhd.flags = 0;
-        moov.trak.mdia.mdhd.creation_time = 0;
-        moov.trak.mdia.mdhd.modification_time = 0;
-        moov.trak.mdia.mdhd.timescale = sample_rate;
-        moov.trak.mdia.mdhd.duration = number_of_samples;
-        moov.trak.mdia.mdhd.language = 0x55c4;
-        moov.trak.mdia.mdhd.quality = 0;
-        // trak/mdia/hdlr
-        moov.trak.mdia.hdlr.version = 0;
-        moov.trak.mdia.hdlr.flags = 0;
-        moov.trak.mdia.hdlr.component_type = 0;
-        moov.trak.mdia.hdlr.handler_type = 0x736F756E;
-        std::fill(moov.trak.mdia.hdlr.reserved, moov.trak.mdia.hdlr.reserved + sizeof(moov.trak.mdia.hdlr.reserved), 0);
-        std::memcpy(moov.trak.mdia.hdlr.name, "SoundHandler", 13);
-        // trak/mdia/minf
-        std::fill(moov.trak.mdia.minf.smhd.reserved, moov.trak.mdia.minf.smhd.reserved + sizeof(moov.trak.mdia.minf.smhd.reserved), 0);
-        moov.trak.mdia.minf.dinf.dref.version = 0;
-        moov.trak.mdia.minf.dinf.dref.flags = 0;
-        moov.trak.mdia.minf.dinf.dref.entry_count = 1;
-        moov.trak.mdia.minf.dinf.dref.data_entries[0].header.type = "url ";
-        moov.trak.mdia.minf.dinf.dref.data_entries[0].version = 1;
-        moov.trak.mdia.minf.dinf.dref.data_entries[0].flags = 0;
-
-        StsdBox::SampleDescriptionEntry sd;
+    // Fills every field of mvhd which does not depend on the tracks.
+    // next_track_id must be larger than the largest track ID in the movie.
+    static void setup_mvhd(MvhdAtom& mvhd, std::uint32_t next_track_id) {
+        mvhd.version = 0;
+        mvhd.flags = 0;
+        mvhd.creation_time = 0;
+        mvhd.modification_time = 0;
+        mvhd.timescale = 1000;
+        mvhd.duration = 0;
+        mvhd.rate = 0x00010000;
+        mvhd.volume = 0x0100;
+        std::fill(mvhd.reserved, mvhd.reserved + sizeof(mvhd.reserved), 0);
+        mvhd.matrix = Matrix<u32>();
+        mvhd.preview_time = 0;
+        mvhd.preview_duration = 0;
+        mvhd.poster_time = 0;
+        mvhd.selection_time = 0;
+        mvhd.selection_duration = 0;
+        mvhd.current_time = 0;
+        mvhd.next_track_id = next_track_id;
+    }
+
+    // Fills every field of an AAC track which does not depend on the stored samples.
+    template<typename Storage>
+    static void setup_trak(BasicTrakBox<Storage>& trak, std::uint32_t track_id, std::uint32_t sample_rate, std::uint16_t number_of_channels) {
+        // tkhd
+        trak.tkhd.version = 0;
+        trak.tkhd.flags = 0x0003;
+        trak.tkhd.creation_time = 0;
+        trak.tkhd.modification_time = 0;
+        trak.tkhd.track_id = track_id;
+        trak.tkhd.reserved_0 = 0;
+        trak.tkhd.duration = 0;
+        std::fill(trak.tkhd.reserved_1, trak.tkhd.reserved_1 + sizeof(trak.tkhd.reserved_1), 0);
+        trak.tkhd.layer = 0;
+        trak.tkhd.alternate_group = 1;
+        trak.tkhd.volume = 0x0100;
+        trak.tkhd.reserved_2 = 0;
+        trak.tkhd.matrix = Matrix<u32>();
+        trak.tkhd.width = 0;
+        trak.tkhd.height = 0;
+        // edts/elst
+        trak.edts.elst.version = 0;
+        trak.edts.elst.flags = 0;
+        ElstEntry edit;
+        edit.segment_duration = 0;
+        edit.media_time = 0x00000800;
+        edit.media_rate = 0x00010000;
+        trak.edts.elst.entries.clear();
+        trak.edts.elst.entries.push_back(edit);
+
+        // mdia/mdhd
+        trak.mdia.mdhd.version = 0;
+        trak.mdia.mdhd.flags = 0;
+        trak.mdia.mdhd.creation_time = 0;
+        trak.mdia.mdhd.modification_time = 0;
+        trak.mdia.mdhd.timescale = sample_rate;
+        trak.mdia.mdhd.duration = 0;
+        trak.mdia.mdhd.language = 0x55c4;
+        trak.mdia.mdhd.quality = 0;
+        // mdia/hdlr
+        trak.mdia.hdlr.version = 0;
+        trak.mdia.hdlr.flags = 0;
+        trak.mdia.hdlr.component_type = 0;
+        trak.mdia.hdlr.handler_type = 0x736F756E;
+        std::fill(trak.mdia.hdlr.reserved, trak.mdia.hdlr.reserved + sizeof(trak.mdia.hdlr.reserved), 0);
+        std::memcpy(trak.mdia.hdlr.name, "SoundHandler", 13);
+        // mdia/minf
+        std::fill(trak.mdia.minf.smhd.reserved, trak.mdia.minf.smhd.reserved + sizeof(trak.mdia.minf.smhd.reserved), 0);
+        trak.mdia.minf.dinf.dref.version = 0;
+        trak.mdia.minf.dinf.dref.flags = 0;
+        trak.mdia.minf.dinf.dref.entry_count = 1;
+        trak.mdia.minf.dinf.dref.data_entries[0].header.type = "url ";
+        trak.mdia.minf.dinf.dref.data_entries[0].version = 1;
+        trak.mdia.minf.dinf.dref.data_entries[0].flags = 0;
+
+        SampleDescriptionEntry sd;
         sd.header.data_reference_index = 1;
         sd.header.version = 0;
         sd.header.revision_level = 0;
         sd.header.vendor = 0;
-        sd.header.number_of_channels = 1;
+        sd.header.number_of_channels = number_of_channels;
         sd.header.sample_size = 16;
         sd.header.compression_id = 0;
         sd.header.packet_size = 0;
@@ -974,7 +1539,8 @@ namespace AACMP4 {
         sd.esds.version = 0;
         sd.esds.desc.tag = EsdsAtom::TAG_ES_DESCRIPTOR;
         AACMP4::array_adapter(sd.esds.desc.size) = {0x80, 0x80, 0x80, 0x25};    // 37 bytes
-        sd.esds.desc.es_id = 1;
+        sd.esds.desc.es_id = std::uint16_t(track_id);
+        sd.esds.desc.flags = 0;     // No stream dependence, URL nor OCR stream
         sd.esds.desc.decoder_config.tag = EsdsAtom::TAG_DECODER_CONFIG;
         AACMP4::array_adapter(sd.esds.desc.decoder_config.size) = {0x80, 0x80, 0x80, 0x17}; // 23 bytes
         sd.esds.desc.decoder_config.object_type = 0x40; // MPEG-4 AAC LC
@@ -984,57 +1550,186 @@ namespace AACMP4 {
         sd.esds.desc.decoder_config.average_bit_rate = 58223;
         sd.esds.desc.decoder_config.decoder_specific.tag = EsdsAtom::TAG_DECODER_SPECIFIC;
         AACMP4::array_adapter(sd.esds.desc.decoder_config.decoder_specific.size) = {0x80, 0x80, 0x80, 0x05}; // 5 bytes
-        AACMP4::array_adapter(sd.esds.desc.decoder_config.decoder_specific.specific) = {0x14, 0x08, 0x56, 0xe5, 0x00};
+        make_audio_specific_config(sd.esds.desc.decoder_config.decoder_specific.specific, sample_rate, number_of_channels);
         sd.esds.desc.sl_config.tag = EsdsAtom::TAG_SL_CONFIG_DESCRIPTOR;
         AACMP4::array_adapter(sd.esds.desc.sl_config.size) = {0x80, 0x80, 0x80, 0x01}; // 1 byte
         sd.esds.desc.sl_config.predefined = 0x02;
         sd.btrt.buffer_size = 0;
         sd.btrt.max_bit_rate = 0;
         sd.btrt.average_bit_rate = 0;
-        moov.trak.mdia.minf.stbl.stsd.header.flags = 0;
-        moov.trak.mdia.minf.stbl.stsd.header.version = 0;
-        moov.trak.mdia.minf.stbl.stsd.sample_description_entries.push_back(sd);
-
-        moov.trak.mdia.minf.stbl.stts.version = 0;
-        moov.trak.mdia.minf.stbl.stts.flags = 0;
-        std::uint32_t remainder_samples = number_of_samples % max_samples_per_chunk;
-        moov.trak.mdia.minf.stbl.stts.number_of_entries = remainder_samples == 0 ? 1 : 2;
-        moov.trak.mdia.minf.stbl.stts.entries[0].count = number_of_samples / max_samples_per_chunk;
-        moov.trak.mdia.minf.stbl.stts.entries[0].duration = max_samples_per_chunk;
+        trak.mdia.minf.stbl.stsd.header.flags = 0;
+        trak.mdia.minf.stbl.stsd.header.version = 0;
+        trak.mdia.minf.stbl.stsd.sample_description_entries.clear();
+        trak.mdia.minf.stbl.stsd.sample_description_entries.push_back(sd);
+
+        trak.mdia.minf.stbl.stts.version = 0;
+        trak.mdia.minf.stbl.stts.flags = 0;
+        trak.mdia.minf.stbl.stts.number_of_entries = 0;
+        trak.mdia.minf.stbl.stsc.version = 0;
+        trak.mdia.minf.stbl.stsc.flags = 0;
+        trak.mdia.minf.stbl.stsc.entries.clear();
+        trak.mdia.minf.stbl.stsz.header.version = 0;
+        trak.mdia.minf.stbl.stsz.header.flags = 0;
+        trak.mdia.minf.stbl.stsz.header.sample_size = 0;
+        trak.mdia.minf.stbl.stco.version = 0;
+        trak.mdia.minf.stbl.stco.flags = 0;
+        trak.mdia.minf.stbl.stco.entries.clear();
+    }
+
+    // Fills every field of the moov box which does not depend on the stored samples.
+    template<typename Storage>
+    static void setup_moov(BasicMoovBox<Storage>& moov, std::uint32_t sample_rate, std::uint16_t number_of_channels) {
+        MvhdAtom& mvhd = moov.mvhd;
+        setup_mvhd(mvhd, 2);
+        setup_trak(moov.trak, 1, sample_rate, number_of_channels);
+    }
+
+    // Attaches the tables of a moov box with ArenaStorage to memory from the arena.
+    // Returns false if the arena is too small.
+    template<typename Storage>
+    static bool allocate_tables(BasicMoovBox<Storage>& moov, Arena& arena, std::size_t max_samples, std::size_t max_chunks = 1, std::size_t max_chunk_runs = 2, std::size_t max_sample_descriptions = 1, std::size_t max_edits = 1) {
+        auto& stbl = moov.trak.mdia.minf.stbl;
+        return moov.trak.edts.elst.entries.attach(arena, max_edits)
+            && stbl.stsd.sample_description_entries.attach(arena, max_sample_descriptions)
+            && stbl.stsc.entries.attach(arena, max_chunk_runs)
+            && stbl.stsz.entries.attach(arena, max_samples)
+            && stbl.stco.entries.attach(arena, max_chunks);
+    }
+
+    // True if a track of number_of_samples fits the 32-bit durations in the movie timescale (ms), i.e. is shorter than about 49 days.
+    // mdhd switches to 64-bit durations by itself; mvhd, tkhd and elst do not.
+    static constexpr bool fits_movie_duration(std::uint32_t sample_rate, std::uint64_t number_of_samples) {
+        return number_of_samples * 1000 / sample_rate <= 0xffffffffu;
+    }
+
+    // Updates the durations and the time-to-sample table of a track for the given number of PCM samples.
+    // The track duration in the movie timescale (ms) is returned. See fits_movie_duration() for its limit.
+    template<typename Storage>
+    static std::uint32_t set_trak_duration(BasicTrakBox<Storage>& trak, std::uint32_t sample_rate, std::uint64_t number_of_samples, std::uint32_t samples_per_frame) {
+        const std::uint32_t duration_ms = std::uint32_t(number_of_samples * 1000 / sample_rate);
+        trak.tkhd.duration = duration_ms;
+        if(!trak.edts.elst.entries.empty()) {
+            trak.edts.elst.entries[0].segment_duration = duration_ms;
+        }
+        trak.mdia.mdhd.duration = number_of_samples;
+
+        auto& stts = trak.mdia.minf.stbl.stts;
+        std::uint32_t remainder_samples = std::uint32_t(number_of_samples % samples_per_frame);
+        stts.number_of_entries = remainder_samples == 0 ? 1 : 2;
+        stts.entries[0].count = std::uint32_t(number_of_samples / samples_per_frame);
+        stts.entries[0].duration = samples_per_frame;
         if(remainder_samples != 0) {
-            moov.trak.mdia.minf.stbl.stts.entries[1].count = 1;
-            moov.trak.mdia.minf.stbl.stts.entries[1].duration = remainder_samples;
-        }
-        moov.trak.mdia.minf.stbl.stsc.version = 0;
-        moov.trak.mdia.minf.stbl.stsc.flags = 0;
-        moov.trak.mdia.minf.stbl.stsc.number_of_entries = 1;
-        moov.trak.mdia.minf.stbl.stsc.entries[0].first_chunk = 1;
-        moov.trak.mdia.minf.stbl.stsc.entries[0].samples_per_chunk = (number_of_samples + max_samples_per_chunk - 1) / max_samples_per_chunk;
-        moov.trak.mdia.minf.stbl.stsc.entries[0].sample_description_id = 1;
-        moov.trak.mdia.minf.stbl.stsz.header.version = 0;
-        moov.trak.mdia.minf.stbl.stsz.header.flags = 0;
-        moov.trak.mdia.minf.stbl.stsz.header.sample_size = 0;
-        moov.trak.mdia.minf.stbl.stsz.entries = chunks;
-        
-        moov.trak.mdia.minf.stbl.stco.version = 0;
-        moov.trak.mdia.minf.stbl.stco.flags = 0;
-        moov.trak.mdia.minf.stbl.stco.number_of_entries = 1;
-        moov.trak.mdia.minf.stbl.stco.entries[0] = 0;
-
-        StsdBox::SampleDescriptionEntry mp4a;
-        mp4a.btrt.average_bit_rate = 58223;
-        mp4a.btrt.max_bit_rate = 69000;
-        mp4a.btrt.buffer_size = 0;
-        
-        moov.trak.mdia.minf.stbl.stsz.entries = chunks;
+            stts.entries[1].count = 1;
+            stts.entries[1].duration = remainder_samples;
+        }
+        return duration_ms;
+    }
+
+    // Updates the durations and the time-to-sample table for the given number of PCM samples.
+    template<typename Storage>
+    static void set_moov_duration(BasicMoovBox<Storage>& moov, std::uint32_t sample_rate, std::uint64_t number_of_samples, std::uint32_t samples_per_frame) {
+        moov.mvhd.duration = set_trak_duration(moov.trak, sample_rate, number_of_samples, samples_per_frame);
+    }
+
+    // Places moov at moov_position with the payload starting payload_gap bytes after the end of moov,
+    // and rebases the chunk offsets, which must be relative to the first payload byte, onto that layout.
+    // moov is recomputed until its size is stable, as rebasing may promote stco to co64.
+    // Returns the position of the first payload byte.
+    template<typename Storage>
+    static std::uint64_t relocate_chunk_offsets(BasicMoovBox<Storage>& moov, std::uint64_t moov_position, std::uint64_t payload_gap) {
+        auto& entries = moov.trak.mdia.minf.stbl.stco.entries;
+        std::uint64_t applied_base = 0;
+        for(;;) {
+            moov.compute();
+            std::uint64_t base = moov_position + std::uint32_t(moov.header.size) + payload_gap;
+            if(base == applied_base) {
+                return base;
+            }
+            for(auto& offset : entries) {
+                offset = offset - applied_base + base;
+            }
+            applied_base = base;
+        }
+    }
+
+    // Sets the bit rates in the sample description from the frame sizes.
+    template<typename Storage>
+    static void set_bit_rates(BasicTrakBox<Storage>& trak, const SampleSizeStats& stats, std::uint32_t sample_rate, std::uint32_t samples_per_frame) {
+        if(stats.count == 0) return;
+        const std::uint64_t average = stats.total_size * 8 * sample_rate / (std::uint64_t(stats.count) * samples_per_frame);
+        const std::uint64_t max = std::uint64_t(stats.max_size) * 8 * sample_rate / samples_per_frame;
+        for(auto& entry : trak.mdia.minf.stbl.stsd.sample_description_entries) {
+            entry.esds.desc.decoder_config.buffer_size = stats.max_size;
+            entry.esds.desc.decoder_config.max_bit_rate = std::uint32_t(max);
+            entry.esds.desc.decoder_config.average_bit_rate = std::uint32_t(average);
+            entry.btrt.buffer_size = stats.max_size;
+            entry.btrt.max_bit_rate = std::uint32_t(max);
+            entry.btrt.average_bit_rate = std::uint32_t(average);
+        }
+    }
+
+    template<typename Storage>
+    static void set_bit_rates(BasicMoovBox<Storage>& moov, const SampleSizeStats& stats, std::uint32_t sample_rate, std::uint32_t samples_per_frame) {
+        set_bit_rates(moov.trak, stats, sample_rate, samples_per_frame);
+    }
+
+    // Writes an AAC MP4 file from native frame sizes and the payload split into segments, e.g. the blocks of a SegmentBuffer.
+    // The segments are written in order as the frames concatenated; a frame may span segments.
+    // The sizes are converted in bulk, and the bit rates are derived from the same pass.
+    template<typename S, typename T>
+    static void write_aac_mp4(S& stream, const T* sizes, std::size_t number_of_frames, const Segment* segments, std::size_t number_of_segments, std::uint32_t sample_rate, std::uint32_t number_of_samples, std::uint32_t samples_per_frame) {
+        FtypAtom ftyp;
+        setup_ftyp(ftyp);
+        write(stream, ftyp);
+
+        MoovBox moov;
+        setup_moov(moov, sample_rate, 1);
+        set_moov_duration(moov, sample_rate, number_of_samples, samples_per_frame);
 
-        moov.compute();
-        // Update the chunk offset
-        moov.trak.mdia.minf.stbl.stco.entries[0] = ftyp.header.size + moov.header.size + 8;    // ftyp box + moov box + mdat header
+        auto& stbl = moov.trak.mdia.minf.stbl;
+        const SampleSizeStats stats = stbl.stsz.append(sizes, number_of_frames);
+        set_bit_rates(moov, stats, sample_rate, samples_per_frame);
+        stbl.stsc.add_chunk(1, number_of_frames);
+        stbl.stco.entries.push_back(0);
+
+        RefMdatBox mdat(segments, number_of_segments);
+        mdat.compute();
+
+        // Update the chunk offset: ftyp box + moov box + mdat header
+        relocate_chunk_offsets(moov, std::uint32_t(ftyp.header.size), mdat.header_size());
         moov.write(stream);
 
+        mdat.write(stream);
+    }
+
+    // Writes an AAC MP4 file from native frame sizes and the contiguous payload.
+    template<typename S, typename T>
+    static void write_aac_mp4(S& stream, const T* sizes, std::size_t number_of_frames, const std::vector<u8>& data, std::uint32_t sample_rate, std::uint32_t number_of_samples, std::uint32_t samples_per_frame) {
+        const Segment segment = {data.data(), data.size()};
+        write_aac_mp4(stream, sizes, number_of_frames, &segment, 1, sample_rate, number_of_samples, samples_per_frame);
+    }
+
+    template<typename S>
+    static void write_aac_mp4(S& stream, const std::vector<u32>& chunks, const std::vector<u8>& data, std::uint32_t sample_rate, std::uint32_t number_of_samples, std::uint32_t max_samples_per_chunk) {
+        FtypAtom ftyp;
+        setup_ftyp(ftyp);
+        write(stream, ftyp);
+
+        MoovBox moov;
+        setup_moov(moov, sample_rate, 1);
+        set_moov_duration(moov, sample_rate, number_of_samples, max_samples_per_chunk);
+
+        moov.trak.mdia.minf.stbl.stsc.add_chunk(1, (number_of_samples + max_samples_per_chunk - 1) / max_samples_per_chunk);
+        moov.trak.mdia.minf.stbl.stsz.entries = chunks;
+        moov.trak.mdia.minf.stbl.stco.entries.push_back(0);
+
         RefMdatBox mdat(data);
         mdat.compute();
+
+        // Update the chunk offset: ftyp box + moov box + mdat header
+        relocate_chunk_offsets(moov, std::uint32_t(ftyp.header.size), mdat.header_size());
+        moov.write(stream);
+
         mdat.write(stream);
     }
 } // namespace AACMP4
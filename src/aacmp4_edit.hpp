@@ -0,0 +1,369 @@
+// SPDX-License-Identifier: BSL-1.0
+// Copyright Kenta Ida 2023.
+// Distributed under the Boost Software License, Version 1.0.
+//    (See accompanying file LICENSE_1_0.txt or copy at
+//          https://www.boost.org/LICENSE_1_0.txt)
+
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+#include "aacmp4.hpp"
+#include "aacmp4_reader.hpp"
+#include "stream_adapter.hpp"
+
+#if defined(AACMP4_HAS_FD_SINK) && __has_include(<fcntl.h>) && __has_include(<sys/stat.h>)
+#include <fcntl.h>
+#include <sys/stat.h>
+#define AACMP4_HAS_FILE_EDIT 1
+#endif
+
+#ifdef AACMP4_HAS_FILE_EDIT
+namespace AACMP4 {
+    enum class EditError {
+        None,
+        Io,             // A file could not be opened, read or written
+        Read,           // An input could not be parsed; see Reader::error()
+        Incompatible,   // The format of an input differs from the first one
+        NoFrames,       // The result would have no frames
+        TooLong,        // The result does not fit in the 32-bit durations
+    };
+
+    struct EditResult {
+        EditError error = EditError::None;
+        std::size_t input = 0;                  // Index of the input which caused the error
+        std::uint64_t number_of_frames = 0;
+        std::uint64_t file_size = 0;
+        std::uint64_t payload_bytes = 0;        // Bytes copied from the inputs
+        std::uint64_t kernel_copied_bytes = 0;  // Of which copied by copy_file_range(), without passing through user space
+    };
+
+    // Reads with pread().
+    struct FdSource {
+        int fd;
+
+        bool read_at(std::uint64_t position, u8* buffer, std::size_t length) const {
+            while(length > 0) {
+                const ssize_t result = ::pread(this->fd, buffer, length, off_t(position));
+                if(result < 0 && errno == EINTR) continue;
+                if(result <= 0) return false;
+                buffer += result;
+                position += std::uint64_t(result);
+                length -= std::size_t(result);
+            }
+            return true;
+        }
+    };
+
+    // An input file opened for editing. Only moov is read.
+    struct EditInput {
+        int fd = -1;
+        std::uint64_t size = 0;
+        Reader reader;
+
+        EditInput() = default;
+        ~EditInput() { this->close(); }
+        EditInput(const EditInput&) = delete;
+        EditInput& operator=(const EditInput&) = delete;
+
+        EditError open(const char* path) {
+            this->fd = ::open(path, O_RDONLY);
+            struct stat st;
+            if(this->fd < 0 || ::fstat(this->fd, &st) != 0) return EditError::Io;
+            this->size = std::uint64_t(st.st_size);
+            FdSource source = {this->fd};
+            if(!this->reader.open(source, this->size)) return this->reader.error() == ReadError::Io ? EditError::Io : EditError::Read;
+            if(this->reader.audio_specific_config_size() != sizeof(EsdsAtom::DecoderSpecificInfo::specific)) return EditError::Incompatible;
+            return EditError::None;
+        }
+        void close(void) {
+            if(this->fd >= 0) ::close(this->fd);
+            this->fd = -1;
+        }
+
+        // Duration of a frame, taken from the first time run.
+        std::uint32_t samples_per_frame(void) const { return this->reader.time_runs().front().duration; }
+        bool compatible_with(const EditInput& other) const {
+            return this->reader.sample_rate() == other.reader.sample_rate()
+                && this->reader.timescale() == other.reader.timescale()
+                && this->reader.number_of_channels() == other.reader.number_of_channels()
+                && this->samples_per_frame() == other.samples_per_frame()
+                && std::memcmp(this->reader.audio_specific_config(), other.reader.audio_specific_config(), this->reader.audio_specific_config_size()) == 0;
+        }
+    };
+
+    // Copies length bytes between two files. copy_file_range() lets the kernel move the data, or the filesystem
+    // share the blocks, without passing them through user space. Falls back to pread()/pwrite() where it is not
+    // available, e.g. across filesystems. Returns false on an I/O error.
+    inline bool copy_file_range_or_fallback(int in_fd, std::uint64_t in_offset, int out_fd, std::uint64_t out_offset, std::uint64_t length, EditResult& result) {
+#if defined(__linux__)
+        while(length > 0) {
+            loff_t in = loff_t(in_offset);
+            loff_t out = loff_t(out_offset);
+            const std::size_t request = length < (std::uint64_t(1) << 30) ? std::size_t(length) : std::size_t(1) << 30;
+            const ssize_t copied = ::copy_file_range(in_fd, &in, out_fd, &out, request, 0);
+            if(copied < 0 && errno == EINTR) continue;
+            if(copied <= 0) {
+                if(copied == 0 || errno == EXDEV || errno == ENOSYS || errno == EINVAL || errno == EOPNOTSUPP) break;
+                return false;
+            }
+            in_offset += std::uint64_t(copied);
+            out_offset += std::uint64_t(copied);
+            length -= std::uint64_t(copied);
+            result.kernel_copied_bytes += std::uint64_t(copied);
+        }
+#endif
+        if(length == 0) return true;
+        std::vector<u8> buffer(std::size_t(length < 1024 * 1024 ? length : 1024 * 1024));
+        FdSource source = {in_fd};
+        while(length > 0) {
+            const std::size_t size = length < buffer.size() ? std::size_t(length) : buffer.size();
+            if(!source.read_at(in_offset, buffer.data(), size)) return false;
+            std::size_t written = 0;
+            while(written < size) {
+                const ssize_t written_now = ::pwrite(out_fd, buffer.data() + written, size - written, off_t(out_offset + written));
+                if(written_now < 0 && errno == EINTR) continue;
+                if(written_now <= 0) return false;
+                written += std::size_t(written_now);
+            }
+            in_offset += size;
+            out_offset += size;
+            length -= size;
+        }
+        return true;
+    }
+
+    // Range of frames of an input placed into the output.
+    struct EditRange {
+        const EditInput* input;
+        std::size_t first_frame;
+        std::size_t number_of_frames;
+        std::uint64_t payload_offset;   // Position of the first byte copied from the input
+        std::uint64_t payload_size;     // Bytes copied, from the first byte of the first frame to the last byte of the last frame
+    };
+
+    inline EditRange make_edit_range(const EditInput& input, std::size_t first_frame, std::size_t number_of_frames) {
+        EditRange range = {&input, first_frame, number_of_frames, 0, 0};
+        if(number_of_frames == 0) return range;
+        const auto& offsets = input.reader.sample_offsets();
+        const auto& sizes = input.reader.sample_sizes();
+        std::uint64_t begin = offsets[first_frame];
+        std::uint64_t end = begin;
+        for(std::size_t i = first_frame; i < first_frame + number_of_frames; i++) {
+            begin = offsets[i] < begin ? offsets[i] : begin;
+            end = offsets[i] + sizes[i] > end ? offsets[i] + sizes[i] : end;
+        }
+        range.payload_offset = begin;
+        range.payload_size = end - begin;
+        return range;
+    }
+
+    // Part of the output track presented by elst: duration samples from media_time, both in the track timescale.
+    struct EditSegment {
+        std::uint64_t media_time;
+        std::uint64_t duration;
+    };
+
+    // Writes an MP4 file holding the frame ranges back to back: ftyp, moov, then one mdat with the ranges copied
+    // by copy_file_range(). The frames keep their layout within each range, and each run of adjacent frames is
+    // one chunk. The format is taken from the first range, and the track is number_of_samples long.
+    // elst presents the segments one after another. The movie timescale is set to the sample rate so that every
+    // edit is sample accurate.
+    inline EditResult write_edited_aac_mp4(const char* output, const EditRange* ranges, std::size_t number_of_ranges, std::uint64_t number_of_samples, const EditSegment* segments, std::size_t number_of_segments) {
+        EditResult result;
+        const Reader& format = ranges[0].input->reader;
+        std::uint64_t presentation_duration = 0;
+        for(std::size_t i = 0; i < number_of_segments; i++) {
+            if(segments[i].media_time > 0xffffffffu) {
+                result.error = EditError::TooLong;
+                return result;
+            }
+            presentation_duration += segments[i].duration;
+        }
+        if(number_of_segments == 0 || presentation_duration > 0xffffffffu) {
+            result.error = number_of_segments == 0 ? EditError::NoFrames : EditError::TooLong;
+            return result;
+        }
+
+        MoovBox moov;
+        setup_moov(moov, format.sample_rate(), format.number_of_channels());
+        for(auto& entry : moov.trak.mdia.minf.stbl.stsd.sample_description_entries) {
+            std::memcpy(entry.esds.desc.decoder_config.decoder_specific.specific, format.audio_specific_config(), format.audio_specific_config_size());
+        }
+        const std::uint32_t samples_per_frame = ranges[0].input->samples_per_frame();
+        set_moov_duration(moov, format.sample_rate(), number_of_samples, samples_per_frame);
+        moov.mvhd.timescale = format.sample_rate();
+        moov.mvhd.duration = std::uint32_t(presentation_duration);
+        moov.trak.tkhd.duration = std::uint32_t(presentation_duration);
+        auto& elst = moov.trak.edts.elst;
+        elst.entries.clear();
+        for(std::size_t i = 0; i < number_of_segments; i++) {
+            ElstEntry edit;
+            edit.segment_duration = std::uint32_t(segments[i].duration);
+            edit.media_time = std::uint32_t(segments[i].media_time);
+            edit.media_rate = 0x00010000;
+            elst.entries.push_back(edit);
+        }
+
+        // Chunk offsets relative to the first payload byte.
+        auto& stbl = moov.trak.mdia.minf.stbl;
+        SampleSizeStats stats;
+        std::uint64_t payload_size = 0;
+        std::uint32_t chunks = 0;
+        for(std::size_t r = 0; r < number_of_ranges; r++) {
+            const EditRange& range = ranges[r];
+            const auto& offsets = range.input->reader.sample_offsets();
+            const auto& sizes = range.input->reader.sample_sizes();
+            stats.merge(stbl.stsz.append(sizes.data() + range.first_frame, range.number_of_frames));
+            std::size_t chunk_frames = 0;
+            for(std::size_t i = range.first_frame; i < range.first_frame + range.number_of_frames; i++) {
+                if(chunk_frames == 0 || offsets[i] != offsets[i - 1] + sizes[i - 1]) {
+                    if(chunk_frames > 0) stbl.stsc.add_chunk(chunks, std::uint32_t(chunk_frames));
+                    stbl.stco.entries.push_back(payload_size + offsets[i] - range.payload_offset);
+                    chunks++;
+                    chunk_frames = 0;
+                }
+                chunk_frames++;
+            }
+            if(chunk_frames > 0) stbl.stsc.add_chunk(chunks, std::uint32_t(chunk_frames));
+            payload_size += range.payload_size;
+            result.number_of_frames += range.number_of_frames;
+        }
+        if(result.number_of_frames == 0) {
+            result.error = EditError::NoFrames;
+            return result;
+        }
+        set_bit_rates(moov, stats, format.sample_rate(), samples_per_frame);
+
+        FtypAtom ftyp;
+        setup_ftyp(ftyp);
+        AtomHeader mdat_header;
+        u64 largesize;
+        RefMdatBox::compute_header(mdat_header, largesize, payload_size);
+        const std::size_t mdat_header_size = sizeof(mdat_header) + (mdat_header.size == 1 ? sizeof(largesize) : 0);
+        const std::uint64_t payload_position = relocate_chunk_offsets(moov, std::uint32_t(ftyp.header.size), mdat_header_size);
+
+        const int fd = ::open(output, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if(fd < 0) {
+            result.error = EditError::Io;
+            return result;
+        }
+        int error;
+        {
+            FdSink sink(fd);
+            AACMP4::write(sink, ftyp);
+            moov.write(sink);
+            AACMP4::write(sink, mdat_header);
+            if(mdat_header.size == 1) {
+                AACMP4::write(sink, largesize);
+            }
+            sink.flush();
+            error = sink.error();
+        }
+        bool failed = error != 0;
+        std::uint64_t position = payload_position;
+        for(std::size_t r = 0; r < number_of_ranges && !failed; r++) {
+            failed = !copy_file_range_or_fallback(ranges[r].input->fd, ranges[r].payload_offset, fd, position, ranges[r].payload_size, result);
+            position += ranges[r].payload_size;
+        }
+        failed = ::close(fd) != 0 || failed;
+        if(failed) {
+            result.error = EditError::Io;
+            return result;
+        }
+        result.payload_bytes = payload_size;
+        result.file_size = position;
+        return result;
+    }
+
+    // Number of samples of an input presented from its media_time(), in the track timescale, if its frames take
+    // span samples of the output. The first edit of the input is exact only in a movie timescale equal to the
+    // track timescale, e.g. after trim_aac_mp4(); otherwise the track duration is presented.
+    inline std::uint64_t presented_samples(const Reader& reader, std::uint64_t span) {
+        const std::uint64_t media_time = reader.media_time() < span ? reader.media_time() : span;
+        std::uint64_t duration = reader.duration() < span - media_time ? reader.duration() : span - media_time;
+        if(reader.edit_duration() != 0 && reader.movie_timescale() == reader.timescale() && reader.edit_duration() < duration) {
+            duration = reader.edit_duration();
+        }
+        return duration;
+    }
+
+    // Concatenates MP4 files written by this library without re-encoding.
+    // The inputs must have the same AudioSpecificConfig, sample rate and channels. Their sample tables are merged
+    // into one moov, and their payloads are copied in one pass by copy_file_range().
+    // Every frame of every input is kept. elst has one edit per input which skips the priming samples of that
+    // input and ends with its presentation, so the inputs play back to back without gaps at the joins.
+    inline EditResult concat_aac_mp4(const char* output, const char* const* inputs, std::size_t number_of_inputs) {
+        EditResult result;
+        if(number_of_inputs == 0) {
+            result.error = EditError::NoFrames;
+            return result;
+        }
+        std::vector<EditInput> files(number_of_inputs);
+        std::vector<EditRange> ranges;
+        std::vector<EditSegment> segments;
+        ranges.reserve(number_of_inputs);
+        segments.reserve(number_of_inputs);
+        std::uint64_t number_of_samples = 0;
+        for(std::size_t i = 0; i < number_of_inputs; i++) {
+            result.error = files[i].open(inputs[i]);
+            if(result.error == EditError::None && !files[i].compatible_with(files[0])) {
+                result.error = EditError::Incompatible;
+            }
+            if(result.error != EditError::None) {
+                result.input = i;
+                return result;
+            }
+            const Reader& reader = files[i].reader;
+            ranges.push_back(make_edit_range(files[i], 0, reader.sample_count()));
+            // The frames of each input are timed as whole frames from the end of the previous input.
+            const std::uint64_t span = std::uint64_t(reader.sample_count()) * files[i].samples_per_frame();
+            const EditSegment segment = {number_of_samples + (reader.media_time() < span ? reader.media_time() : span), presented_samples(reader, span)};
+            if(segment.duration > 0) segments.push_back(segment);
+            // The last input keeps the duration of its last frame.
+            number_of_samples += i + 1 < number_of_inputs ? span : reader.duration();
+        }
+        return write_edited_aac_mp4(output, ranges.data(), ranges.size(), number_of_samples, segments.data(), segments.size());
+    }
+
+    // Number of frames decoded before the first frame of a trimmed range and dropped by elst.
+    // AAC needs the previous frame for the overlap of the first one.
+    static constexpr std::size_t TRIM_PREROLL_FRAMES = 1;
+
+    // Writes the part of an MP4 file written by this library between start and end, without re-encoding.
+    // start and end are presentation times in samples of the track timescale (the sample rate), i.e. 0 is the first
+    // sample after the priming samples skipped by elst. end is clamped to the end of the input.
+    // Only the frames covering the range (and one preceding frame as pre-roll) are copied, as one byte range by
+    // copy_file_range(). elst drops the samples of the partial frames at both ends.
+    inline EditResult trim_aac_mp4(const char* output, const char* input, std::uint64_t start, std::uint64_t end) {
+        EditResult result;
+        EditInput file;
+        result.error = file.open(input);
+        if(result.error != EditError::None) return result;
+
+        const Reader& reader = file.reader;
+        const std::uint64_t priming = reader.media_time();
+        const std::uint64_t presentation_end = reader.duration() > priming ? reader.duration() - priming : 0;
+        end = end < presentation_end ? end : presentation_end;
+        if(start >= end || reader.sample_count() == 0) {
+            result.error = EditError::NoFrames;
+            return result;
+        }
+
+        // Frames covering [start, end) in media time.
+        std::size_t first = reader.find_sample(start + priming);
+        first = first > TRIM_PREROLL_FRAMES ? first - TRIM_PREROLL_FRAMES : 0;
+        std::size_t last = reader.find_sample(end + priming - 1);
+        last = last < reader.sample_count() ? last : reader.sample_count() - 1;
+
+        const SampleInfo first_sample = reader.sample(first);
+        const SampleInfo last_sample = reader.sample(last);
+        const std::uint64_t number_of_samples = last_sample.timestamp + last_sample.duration - first_sample.timestamp;
+        const EditRange range = make_edit_range(file, first, last - first + 1);
+        const EditSegment segment = {start + priming - first_sample.timestamp, end - start};
+        return write_edited_aac_mp4(output, &range, 1, number_of_samples, &segment, 1);
+    }
+} // namespace AACMP4
+#endif
@@ -0,0 +1,114 @@
+// SPDX-License-Identifier: BSL-1.0
+// Copyright Kenta Ida 2023.
+// Distributed under the Boost Software License, Version 1.0.
+//    (See accompanying file LICENSE_1_0.txt or copy at
+//          https://www.boost.org/LICENSE_1_0.txt)
+
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+#include "aacmp4.hpp"
+#include "durable_sink.hpp"
+
+namespace AACMP4 {
+    struct FragmentConfig {
+        // Maximum duration of the frames held before a fragment is emitted.
+        std::uint32_t fragment_duration_ms = 500;
+        // Maximum payload held before a fragment is emitted.
+        std::size_t max_fragment_bytes = 64 * 1024;
+    };
+
+    // Writes a fragmented MP4 stream for live output.
+    // The init segment (ftyp and moov with mvex) is written on construction,
+    // then a moof and mdat pair is written for every fragment.
+    // Only the payload and the sample sizes of the current fragment are kept in memory.
+    template<typename S>
+    class FragmentedAacMp4Writer {
+    public:
+        FragmentedAacMp4Writer(S& stream, std::uint32_t sample_rate, std::uint32_t samples_per_frame = 1024, std::uint16_t number_of_channels = 1, const FragmentConfig& config = FragmentConfig())
+            : stream(stream), samples_per_frame(samples_per_frame), config(config)
+        {
+            FtypAtom ftyp;
+            setup_ftyp(ftyp);
+            ftyp.compatible_brands[0] = "iso6";
+            AACMP4::write(this->stream, ftyp);
+
+            MoovBox moov;
+            setup_moov(moov, sample_rate, number_of_channels);
+            moov.fragmented = true;
+            moov.mvex.trex.version = 0;
+            moov.mvex.trex.flags = 0;
+            moov.mvex.trex.track_id = 1;
+            moov.mvex.trex.default_sample_description_index = 1;
+            moov.mvex.trex.default_sample_duration = samples_per_frame;
+            moov.mvex.trex.default_sample_size = 0;
+            moov.mvex.trex.default_sample_flags = 0;
+            moov.compute();
+            moov.write(this->stream);
+
+            this->frames_per_fragment = std::uint64_t(config.fragment_duration_ms) * sample_rate / 1000 / samples_per_frame;
+            if(this->frames_per_fragment == 0) {
+                this->frames_per_fragment = 1;
+            }
+            this->payload.reserve(config.max_fragment_bytes);
+            this->moof.traf.trun.entries.reserve(this->frames_per_fragment);
+            this->moof.mfhd.version = 0;
+            this->moof.mfhd.flags = 0;
+            this->moof.traf.tfhd.version = 0;
+            this->moof.traf.tfhd.track_id = 1;
+            this->moof.traf.tfhd.default_sample_duration = samples_per_frame;
+            this->moof.traf.tfdt.flags = 0;
+            this->moof.traf.trun.header.version = 0;
+        }
+
+        // Appends an encoded AAC frame. A fragment is emitted when the configured duration or size is reached.
+        void add_frame(const u8* data, std::size_t size) {
+            if(!this->payload.empty() && this->payload.size() + size > this->config.max_fragment_bytes) {
+                this->flush();
+            }
+            this->payload.insert(this->payload.end(), data, data + size);
+            this->moof.traf.trun.entries.push_back(std::uint32_t(size));
+            if(this->moof.traf.trun.entries.size() >= this->frames_per_fragment) {
+                this->flush();
+            }
+        }
+
+        // Emits the frames held so far as a moof and mdat pair.
+        void flush(void) {
+            auto& entries = this->moof.traf.trun.entries;
+            if(entries.empty()) return;
+
+            this->moof.mfhd.sequence_number = this->sequence_number++;
+            this->moof.traf.tfdt.base_media_decode_time = this->decode_time;
+            this->moof.compute();
+            this->moof.traf.trun.header.data_offset = std::uint32_t(this->moof.header.size) + sizeof(AtomHeader);
+            this->moof.write(this->stream);
+
+            AtomHeader mdat_header;
+            mdat_header.size = sizeof(mdat_header) + this->payload.size();
+            mdat_header.type = RefMdatBox::TYPE;
+            AACMP4::write(this->stream, mdat_header);
+            AACMP4::write(this->stream, this->payload);
+
+            this->decode_time += std::uint64_t(entries.size()) * this->samples_per_frame;
+            entries.clear();
+            this->payload.clear();
+            mark_fragment_boundary(this->stream);
+        }
+
+        void finalize(void) {
+            this->flush();
+        }
+    private:
+        S& stream;
+        std::uint32_t samples_per_frame;
+        FragmentConfig config;
+        std::size_t frames_per_fragment;
+        MoofBox moof;
+        std::vector<u8> payload;
+        std::uint32_t sequence_number = 1;
+        std::uint64_t decode_time = 0;
+    };
+} // namespace AACMP4
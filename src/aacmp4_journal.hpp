@@ -0,0 +1,274 @@
+// SPDX-License-Identifier: BSL-1.0
+// Copyright Kenta Ida 2023.
+// Distributed under the Boost Software License, Version 1.0.
+//    (See accompanying file LICENSE_1_0.txt or copy at
+//          https://www.boost.org/LICENSE_1_0.txt)
+
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+#include "aacmp4.hpp"
+#include "stream_adapter.hpp"
+
+#if __has_include(<unistd.h>) && __has_include(<fcntl.h>)
+#define AACMP4_HAS_FRAME_JOURNAL
+#include <cerrno>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+namespace AACMP4 {
+    // Journal of the frames written by AacMp4Writer, used to rebuild moov when the writer did not finish.
+    //
+    // Layout (big-endian):
+    //   JournalHeader
+    //   batches of { JournalBatchHeader, u32 sizes[count] }
+    // The frames are stored back to back from payload_position. A batch is written by a single write(),
+    // so a crash leaves at most one incomplete batch at the end, which is ignored on recovery.
+    struct __attribute__((packed)) JournalHeader {
+        static constexpr const char* MAGIC = "AMJ1";
+        BoxType magic;
+        u32 sample_rate;
+        u32 samples_per_frame;
+        u16 number_of_channels;
+        u16 reserved;
+        u64 payload_position;
+    };
+    template<> struct is_trivially_serializable<JournalHeader> : std::true_type {};
+
+    struct __attribute__((packed)) JournalBatchHeader {
+        u32 count;
+        u64 first_sample;   // Timestamp of the first frame in the batch, in PCM samples.
+    };
+    template<> struct is_trivially_serializable<JournalBatchHeader> : std::true_type {};
+
+#ifdef AACMP4_HAS_FRAME_JOURNAL
+    struct JournalStats {
+        std::uint64_t frames = 0;
+        std::uint64_t batches = 0;
+        std::uint64_t bytes = 0;
+        std::uint64_t write_time_ns = 0;   // Time spent in write().
+    };
+
+    // Appends the journal to a file. Frame sizes are collected in memory and written every batch_frames frames.
+    // The first error is kept in error() and the following writes are ignored.
+    class FrameJournal {
+    public:
+        FrameJournal() = default;
+        FrameJournal(const FrameJournal&) = delete;
+        FrameJournal& operator=(const FrameJournal&) = delete;
+        ~FrameJournal() { this->close(); }
+
+        bool open(const char* path, std::size_t batch_frames = 256) {
+            this->close();
+            this->fd = ::open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+            if(this->fd < 0) {
+                this->error_ = errno;
+                return false;
+            }
+            this->batch_frames = batch_frames > 0 ? batch_frames : 1;
+            this->buffer.resize(sizeof(JournalBatchHeader) + this->batch_frames * sizeof(u32));
+            this->error_ = 0;
+            return true;
+        }
+        // Flushes the pending frames and closes the file.
+        void close(void) {
+            if(this->fd < 0) return;
+            this->flush();
+            ::close(this->fd);
+            this->fd = -1;
+        }
+
+        // Called by the writer when the payload starts.
+        void begin(std::uint32_t sample_rate, std::uint32_t samples_per_frame, std::uint16_t number_of_channels, std::uint64_t payload_position) {
+            JournalHeader header;
+            header.magic = JournalHeader::MAGIC;
+            header.sample_rate = sample_rate;
+            header.samples_per_frame = samples_per_frame;
+            header.number_of_channels = number_of_channels;
+            header.reserved = 0;
+            header.payload_position = payload_position;
+            this->samples_per_frame = samples_per_frame;
+            this->next_sample = 0;
+            this->pending = 0;
+            this->write(reinterpret_cast<const u8*>(&header), sizeof(header));
+        }
+
+        // Records frames appended by the writer.
+        void add(std::uint32_t size) {
+            reinterpret_cast<u32*>(this->buffer.data() + sizeof(JournalBatchHeader))[this->pending++] = size;
+            if(this->pending == this->batch_frames) {
+                this->flush();
+            }
+        }
+        template<typename T>
+        void add(const T* sizes, std::size_t count) {
+            for(std::size_t i = 0; i < count; i++) {
+                this->add(std::uint32_t(sizes[i]));
+            }
+        }
+
+        // Writes the pending frames as a batch.
+        void flush(void) {
+            if(this->pending == 0) return;
+            JournalBatchHeader header;
+            header.count = std::uint32_t(this->pending);
+            header.first_sample = this->next_sample;
+            std::memcpy(this->buffer.data(), &header, sizeof(header));
+            this->write(this->buffer.data(), sizeof(header) + this->pending * sizeof(u32));
+            this->stats_.frames += this->pending;
+            this->stats_.batches++;
+            this->next_sample += std::uint64_t(this->pending) * this->samples_per_frame;
+            this->pending = 0;
+        }
+
+        const JournalStats& stats(void) const { return this->stats_; }
+        int error(void) const { return this->error_; }
+    private:
+        void write(const u8* data, std::size_t size) {
+            if(this->fd < 0 || this->error_ != 0) return;
+            const auto start = std::chrono::steady_clock::now();
+            this->stats_.bytes += size;
+            while(size > 0) {
+                ssize_t result = ::write(this->fd, data, size);
+                if(result < 0) {
+                    if(errno == EINTR) continue;
+                    this->error_ = errno;
+                    break;
+                }
+                data += result;
+                size -= std::size_t(result);
+            }
+            this->stats_.write_time_ns += std::uint64_t(std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count());
+        }
+
+        int fd = -1;
+        int error_ = 0;
+        std::size_t batch_frames = 0;
+        std::size_t pending = 0;
+        std::uint32_t samples_per_frame = 0;
+        std::uint64_t next_sample = 0;
+        std::vector<u8> buffer;
+        JournalStats stats_;
+    };
+#endif // AACMP4_HAS_FRAME_JOURNAL
+
+    // Frames read back from a journal.
+    struct JournalContents {
+        std::uint32_t sample_rate = 0;
+        std::uint32_t samples_per_frame = 0;
+        std::uint16_t number_of_channels = 0;
+        std::uint64_t payload_position = 0;
+        std::vector<u32> sizes;
+    };
+
+    // Parses a journal. An incomplete batch at the end is ignored. Returns false if the header is invalid.
+    static bool parse_journal(const u8* data, std::size_t size, JournalContents& contents) {
+        JournalHeader header;
+        if(!read(data, size, header) || !(header.magic == BoxType(JournalHeader::MAGIC)) || std::uint32_t(header.samples_per_frame) == 0) {
+            return false;
+        }
+        contents.sample_rate = header.sample_rate;
+        contents.samples_per_frame = header.samples_per_frame;
+        contents.number_of_channels = header.number_of_channels;
+        contents.payload_position = header.payload_position;
+        contents.sizes.clear();
+        std::size_t offset = sizeof(header);
+        for(;;) {
+            JournalBatchHeader batch;
+            if(!read(data + offset, size - offset, batch)) break;
+            const std::uint32_t count = batch.count;
+            if((size - offset - sizeof(batch)) / sizeof(u32) < count) break;
+            // Batches must follow each other without gaps.
+            if(std::uint64_t(batch.first_sample) != std::uint64_t(contents.sizes.size()) * contents.samples_per_frame) break;
+            const u32* sizes = reinterpret_cast<const u32*>(data + offset + sizeof(batch));
+            contents.sizes.insert(contents.sizes.end(), sizes, sizes + count);
+            offset += sizeof(batch) + count * sizeof(u32);
+        }
+        return true;
+    }
+
+    enum class RecoveryError {
+        None,
+        BadJournal,     // The journal header is missing or invalid.
+        NoFrames,       // No journaled frame is complete in the file.
+    };
+
+    struct RecoveryResult {
+        RecoveryError error = RecoveryError::None;
+        std::size_t number_of_frames = 0;   // Frames indexed in the rebuilt moov.
+        std::uint64_t file_size = 0;        // Size of the recovered file. The file should be truncated to it.
+    };
+
+    // Rebuilds moov for a file whose writer did not reach finalize(), from the journal written alongside it.
+    // Frames which are journaled but not completely in the file are dropped, as are payload bytes which
+    // are not journaled. The mdat size is patched and moov is written after the last frame.
+    // The stream must provide write_at(); file_size is the current size of the file.
+    template<typename S>
+    static RecoveryResult recover_aac_mp4(S& stream, std::uint64_t file_size, const u8* journal, std::size_t journal_size) {
+        RecoveryResult result;
+        JournalContents contents;
+        if(!parse_journal(journal, journal_size, contents) || contents.payload_position < 2 * sizeof(AtomHeader) || contents.sample_rate == 0) {
+            result.error = RecoveryError::BadJournal;
+            return result;
+        }
+
+        // Keep the frames which are complete in the file.
+        std::uint64_t payload_size = 0;
+        std::size_t number_of_frames = 0;
+        for(const auto& size : contents.sizes) {
+            if(contents.payload_position + payload_size + std::uint32_t(size) > file_size) break;
+            payload_size += std::uint32_t(size);
+            number_of_frames++;
+        }
+        if(number_of_frames == 0) {
+            result.error = RecoveryError::NoFrames;
+            return result;
+        }
+
+        MoovBox moov;
+        setup_moov(moov, contents.sample_rate, contents.number_of_channels);
+        auto& stbl = moov.trak.mdia.minf.stbl;
+        stbl.stsz.entries.assign(contents.sizes.begin(), contents.sizes.begin() + number_of_frames);
+        stbl.stsc.add_chunk(1, std::uint32_t(number_of_frames));
+        stbl.stco.entries.push_back(contents.payload_position);
+        SampleSizeStats stats;
+        stats.count = number_of_frames;
+        stats.total_size = payload_size;
+        for(std::size_t i = 0; i < number_of_frames; i++) {
+            const std::uint32_t size = stbl.stsz.entries[i];
+            stats.max_size = size > stats.max_size ? size : stats.max_size;
+        }
+        set_bit_rates(moov, stats, contents.sample_rate, contents.samples_per_frame);
+        set_moov_duration(moov, contents.sample_rate, std::uint64_t(number_of_frames) * contents.samples_per_frame, contents.samples_per_frame);
+        moov.compute();
+
+        // Patch the mdat header in front of the payload, widening it over the placeholder if required.
+        const std::uint64_t mdat_position = contents.payload_position - 2 * sizeof(AtomHeader);
+        AtomHeader mdat_header;
+        u64 largesize;
+        RefMdatBox::compute_header(mdat_header, largesize, payload_size);
+        if(mdat_header.size == 1) {
+            u8 header[sizeof(AtomHeader) + sizeof(u64)];
+            std::memcpy(header, &mdat_header, sizeof(AtomHeader));
+            std::memcpy(header + sizeof(AtomHeader), &largesize, sizeof(u64));
+            stream.write_at(mdat_position, header, sizeof(header));
+        }
+        else {
+            stream.write_at(mdat_position + sizeof(AtomHeader), reinterpret_cast<const u8*>(&mdat_header), sizeof(mdat_header));
+        }
+
+        const std::uint64_t moov_position = contents.payload_position + payload_size;
+        {
+            PositionedStream<S> positioned(stream, moov_position);
+            moov.write(positioned);
+        }
+        result.number_of_frames = number_of_frames;
+        result.file_size = moov_position + std::uint32_t(moov.header.size);
+        return result;
+    }
+} // namespace AACMP4
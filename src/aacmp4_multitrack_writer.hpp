@@ -0,0 +1,222 @@
+// SPDX-License-Identifier: BSL-1.0
+// Copyright Kenta Ida 2023.
+// Distributed under the Boost Software License, Version 1.0.
+//    (See accompanying file LICENSE_1_0.txt or copy at
+//          https://www.boost.org/LICENSE_1_0.txt)
+
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+#include "aacmp4.hpp"
+#include "durable_sink.hpp"
+
+namespace AACMP4 {
+    // moov box with any number of tracks.
+    struct MultiTrackMoovBox {
+        AtomHeader header;
+        MvhdAtom mvhd;
+        std::vector<TrakBox> traks;
+
+        static constexpr const char* TYPE = "moov";
+        void compute(void) {
+            this->mvhd.compute();
+            this->header.size = sizeof(this->header) + this->mvhd.header.size;
+            for(auto& trak : this->traks) {
+                trak.compute();
+                this->header.size = this->header.size + trak.header.size;
+            }
+            this->header.type = TYPE;
+        }
+
+        template<typename S> void write(S& stream) const {
+            AACMP4::write(stream, this->header);
+            AACMP4::write(stream, this->mvhd);
+            for(const auto& trak : this->traks) {
+                AACMP4::write(stream, trak);
+            }
+        }
+    };
+
+    // Format of one AAC track.
+    struct TrackConfig {
+        std::uint32_t sample_rate = 48000;
+        std::uint32_t samples_per_frame = 1024;
+        std::uint16_t number_of_channels = 1;
+        // Tracks sharing a non-zero group are alternatives, e.g. languages, of which players present only one.
+        // 0 presents the track together with the others, as for simultaneous microphones.
+        std::uint16_t alternate_group = 0;
+    };
+
+    struct MultiTrackWriterConfig {
+        // Duration of the interleave unit. The frames of every track within a unit are written as one chunk per
+        // track, and the chunks of a unit are placed back to back in track order. 0 is treated as 1.
+        std::uint32_t interleave_duration_ms = 500;
+        // Maximum payload held for the tracks waiting for a slower track. When exceeded, the current unit is
+        // written with the frames available; frames arriving late for it go into the following unit.
+        std::size_t max_pending_bytes = 4 * 1024 * 1024;
+    };
+
+    // Writes an MP4 file with several AAC tracks, such as one per microphone.
+    // The frames of each track are held until every track has reached the end of the current interleave unit,
+    // so that the data of all tracks around a timestamp is one contiguous range of mdat.
+    // ftyp and an open mdat are written on construction and moov is written after mdat by finalize().
+    // The stream must provide write(), position() and write_at() like StreamAdapter.
+    template<typename S>
+    class MultiTrackAacMp4Writer {
+    public:
+        MultiTrackAacMp4Writer(S& stream, const std::vector<TrackConfig>& tracks, const MultiTrackWriterConfig& config = MultiTrackWriterConfig())
+            : stream(stream), config(config), tracks(tracks.size())
+        {
+            if(this->config.interleave_duration_ms == 0) {
+                this->config.interleave_duration_ms = 1;
+            }
+            setup_mvhd(this->moov.mvhd, std::uint32_t(tracks.size() + 1));
+            this->moov.traks.resize(tracks.size());
+            for(std::size_t i = 0; i < tracks.size(); i++) {
+                this->tracks[i].config = tracks[i];
+                setup_trak(this->moov.traks[i], std::uint32_t(i + 1), tracks[i].sample_rate, tracks[i].number_of_channels);
+                this->moov.traks[i].tkhd.alternate_group = tracks[i].alternate_group;
+            }
+
+            FtypAtom ftyp;
+            setup_ftyp(ftyp);
+            AACMP4::write(this->stream, ftyp);
+
+            // The mdat size is patched by finalize(), widening the header over the placeholder if required.
+            FreeBox placeholder;
+            placeholder.compute();
+            this->mdat_position = this->stream.position();
+            AACMP4::write(this->stream, placeholder);
+            AtomHeader mdat_header;
+            mdat_header.size = 0;
+            mdat_header.type = RefMdatBox::TYPE;
+            AACMP4::write(this->stream, mdat_header);
+        }
+
+        std::size_t number_of_tracks(void) const { return this->tracks.size(); }
+        std::size_t number_of_frames(std::size_t track) const { return this->tracks[track].frames; }
+
+        // Appends an encoded AAC frame to a track. Returns false if the track does not exist.
+        bool add_frame(std::size_t track, const u8* data, std::size_t size) {
+            if(track >= this->tracks.size() || this->finalized) return false;
+            auto& state = this->tracks[track];
+            state.payload.insert(state.payload.end(), data, data + size);
+            state.sizes.push_back(std::uint32_t(size));
+            state.frames++;
+            this->pending_bytes += size;
+            this->write_ready_units();
+            return true;
+        }
+
+        // Writes the frames held so far and completes the file.
+        void finalize(void) {
+            if(this->finalized) return;
+            this->finalized = true;
+            while(this->has_pending_frames()) {
+                this->write_unit();
+            }
+
+            AtomHeader mdat_header;
+            u64 largesize;
+            RefMdatBox::compute_header(mdat_header, largesize, this->payload_size);
+            if(mdat_header.size == 1) {
+                u8 header[sizeof(AtomHeader) + sizeof(u64)];
+                std::memcpy(header, &mdat_header, sizeof(AtomHeader));
+                std::memcpy(header + sizeof(AtomHeader), &largesize, sizeof(u64));
+                this->stream.write_at(this->mdat_position, header, sizeof(header));
+            }
+            else {
+                this->stream.write_at(this->mdat_position + sizeof(AtomHeader), mdat_header.size.octets, sizeof(mdat_header.size));
+            }
+
+            std::uint32_t duration_ms = 0;
+            for(std::size_t i = 0; i < this->tracks.size(); i++) {
+                const auto& state = this->tracks[i];
+                auto& trak = this->moov.traks[i];
+                const std::uint64_t number_of_samples = std::uint64_t(state.frames) * state.config.samples_per_frame;
+                const std::uint32_t track_duration_ms = set_trak_duration(trak, state.config.sample_rate, number_of_samples, state.config.samples_per_frame);
+                duration_ms = track_duration_ms > duration_ms ? track_duration_ms : duration_ms;
+                set_bit_rates(trak, state.stats, state.config.sample_rate, state.config.samples_per_frame);
+            }
+            this->moov.mvhd.duration = duration_ms;
+            this->moov.compute();
+            this->moov.write(this->stream);
+        }
+    private:
+        struct TrackState {
+            TrackConfig config;
+            std::vector<u8> payload;            // Frames not written yet
+            std::vector<std::uint32_t> sizes;
+            std::uint64_t frames = 0;           // Frames added so far
+            std::uint64_t written_frames = 0;
+            std::uint32_t chunks = 0;
+            SampleSizeStats stats;
+        };
+
+        // Number of frames of the track which start before the end of the given interleave unit.
+        std::uint64_t frames_until_unit_end(const TrackState& state, std::uint64_t unit) const {
+            const std::uint64_t end = (unit + 1) * this->config.interleave_duration_ms * state.config.sample_rate;
+            const std::uint64_t frame = std::uint64_t(state.config.samples_per_frame) * 1000;
+            return (end + frame - 1) / frame;
+        }
+
+        bool has_pending_frames(void) const {
+            for(const auto& state : this->tracks) {
+                if(state.written_frames < state.frames) return true;
+            }
+            return false;
+        }
+
+        void write_ready_units(void) {
+            while(this->has_pending_frames()) {
+                bool ready = this->pending_bytes > this->config.max_pending_bytes;
+                if(!ready) {
+                    ready = true;
+                    for(const auto& state : this->tracks) {
+                        ready = ready && state.frames >= this->frames_until_unit_end(state, this->unit);
+                    }
+                }
+                if(!ready) return;
+                this->write_unit();
+            }
+        }
+
+        // Writes the held frames of the current interleave unit as one chunk per track.
+        void write_unit(void) {
+            for(std::size_t i = 0; i < this->tracks.size(); i++) {
+                auto& state = this->tracks[i];
+                const std::uint64_t end = this->frames_until_unit_end(state, this->unit);
+                const std::size_t count = std::size_t((end < state.frames ? end : state.frames) - state.written_frames);
+                if(count == 0) continue;
+
+                auto& stbl = this->moov.traks[i].mdia.minf.stbl;
+                const SampleSizeStats stats = stbl.stsz.append(state.sizes.data(), count);
+                stbl.stco.entries.push_back(this->stream.position());
+                stbl.stsc.add_chunk(++state.chunks, std::uint32_t(count));
+                AACMP4::write(this->stream, state.payload.data(), stats.total_size);
+
+                state.stats.merge(stats);
+                state.written_frames += count;
+                state.payload.erase(state.payload.begin(), state.payload.begin() + stats.total_size);
+                state.sizes.erase(state.sizes.begin(), state.sizes.begin() + count);
+                this->payload_size += stats.total_size;
+                this->pending_bytes -= stats.total_size;
+            }
+            this->unit++;
+            mark_fragment_boundary(this->stream);
+        }
+
+        S& stream;
+        MultiTrackWriterConfig config;
+        std::vector<TrackState> tracks;
+        MultiTrackMoovBox moov;
+        std::uint64_t mdat_position = 0;
+        std::uint64_t payload_size = 0;
+        std::uint64_t pending_bytes = 0;
+        std::uint64_t unit = 0;     // Interleave unit written next
+        bool finalized = false;
+    };
+} // namespace AACMP4
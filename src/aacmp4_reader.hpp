@@ -0,0 +1,541 @@
+// SPDX-License-Identifier: BSL-1.0
+// Copyright Kenta Ida 2023.
+// Distributed under the Boost Software License, Version 1.0.
+//    (See accompanying file LICENSE_1_0.txt or copy at
+//          https://www.boost.org/LICENSE_1_0.txt)
+
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+#include "aacmp4.hpp"
+
+#if __has_include(<sys/mman.h>) && __has_include(<unistd.h>) && __has_include(<fcntl.h>)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#define AACMP4_HAS_MAPPED_READER 1
+#endif
+
+namespace AACMP4 {
+    // Reads from a memory block.
+    struct MemorySource {
+        const u8* data;
+        std::size_t size;
+
+        bool read_at(std::uint64_t position, u8* buffer, std::size_t length) const {
+            if(position > this->size || length > this->size - position) return false;
+            std::memcpy(buffer, this->data + position, length);
+            return true;
+        }
+    };
+
+    // Reads from a std::istream like object.
+    template<typename T>
+    struct StreamSource {
+        T& stream;
+        StreamSource(T& stream) : stream(stream) {}
+
+        bool read_at(std::uint64_t position, u8* buffer, std::size_t length) {
+            this->stream.clear();
+            this->stream.seekg(position);
+            this->stream.read(reinterpret_cast<char*>(buffer), length);
+            return std::size_t(this->stream.gcount()) == length;
+        }
+        std::uint64_t size(void) {
+            this->stream.clear();
+            this->stream.seekg(0, T::end);
+            return std::uint64_t(this->stream.tellg());
+        }
+    };
+
+    struct SampleInfo {
+        std::uint64_t offset;       // Position of the frame in the file
+        std::uint32_t size;         // Size of the frame
+        std::uint64_t timestamp;    // Decode time in the media timescale
+        std::uint32_t duration;     // Duration in the media timescale
+    };
+
+    enum class ReadError {
+        None,
+        Io,             // The source could not be read
+        NoMoov,         // No moov box
+        NoTrack,        // No audio track with an mp4a sample description
+        Malformed,      // A box is truncated or inconsistent
+    };
+
+    // Parses the sample tables of an audio track of an MP4 file into flat arrays. The first one by default.
+    // Only the moov box is read from the source.
+    // The per-sample offsets are accumulated once when opening, so a sample lookup does not walk the tables.
+    class Reader {
+    public:
+        // Time-to-sample run with its first sample and decode time.
+        struct TimeRun {
+            std::uint32_t first_sample;
+            std::uint32_t count;
+            std::uint64_t first_time;
+            std::uint32_t duration;
+        };
+
+        // track selects the audio track by its order in moov.
+        bool open(const u8* data, std::size_t size, std::size_t track = 0) {
+            MemorySource source = {data, size};
+            return this->open(source, size, track);
+        }
+
+        // Source must provide bool read_at(position, buffer, length).
+        template<typename Source>
+        bool open(Source& source, std::uint64_t file_size, std::size_t track = 0) {
+            *this = Reader();
+            std::uint64_t position = 0;
+            std::vector<u8> moov;
+            while(position + sizeof(AtomHeader) <= file_size) {
+                u8 buffer[sizeof(AtomHeader) + sizeof(u64)];
+                std::size_t header_size = sizeof(AtomHeader);
+                if(!source.read_at(position, buffer, header_size)) return this->fail(ReadError::Io);
+                AtomHeader header;
+                read(buffer, header_size, header);
+                std::uint64_t box_size = std::uint32_t(header.size);
+                if(box_size == 1) {
+                    if(!source.read_at(position + header_size, buffer + header_size, sizeof(u64))) return this->fail(ReadError::Io);
+                    u64 largesize;
+                    read(buffer + header_size, sizeof(u64), largesize);
+                    box_size = largesize;
+                    header_size += sizeof(u64);
+                }
+                else if(box_size == 0) {
+                    box_size = file_size - position;
+                }
+                if(box_size < header_size || box_size > file_size - position) return this->fail(ReadError::Malformed);
+
+                if(header.type == BoxType(MoovBox::TYPE) && moov.empty()) {
+                    moov.resize(box_size - header_size);
+                    if(!source.read_at(position + header_size, moov.data(), moov.size())) return this->fail(ReadError::Io);
+                }
+                else if(header.type == BoxType(RefMdatBox::TYPE) && this->mdat_size_ == 0) {
+                    this->mdat_offset_ = position + header_size;
+                    this->mdat_size_ = box_size - header_size;
+                }
+                position += box_size;
+            }
+            if(moov.empty()) return this->fail(ReadError::NoMoov);
+            return this->parse_moov(moov.data(), moov.size(), track);
+        }
+
+        ReadError error(void) const { return this->error_; }
+
+        std::size_t sample_count(void) const { return this->sample_sizes_.size(); }
+        std::uint32_t timescale(void) const { return this->timescale_; }
+        // Duration of the media in the media timescale.
+        std::uint64_t duration(void) const { return this->duration_; }
+        std::uint32_t sample_rate(void) const { return this->sample_rate_; }
+        std::uint16_t number_of_channels(void) const { return this->number_of_channels_; }
+        // Media time of the first edit, i.e. the number of priming samples to skip. 0 if no edit list.
+        std::uint64_t media_time(void) const { return this->media_time_; }
+        // Duration of the first edit in the movie timescale. 0 if no edit list.
+        std::uint64_t edit_duration(void) const { return this->edit_duration_; }
+        std::uint32_t movie_timescale(void) const { return this->movie_timescale_; }
+
+        const u8* audio_specific_config(void) const { return this->audio_specific_config_.data(); }
+        std::size_t audio_specific_config_size(void) const { return this->audio_specific_config_.size(); }
+
+        // Position and size of the payload of the first mdat box.
+        std::uint64_t mdat_offset(void) const { return this->mdat_offset_; }
+        std::uint64_t mdat_size(void) const { return this->mdat_size_; }
+
+        const std::vector<std::uint32_t>& sample_sizes(void) const { return this->sample_sizes_; }
+        const std::vector<std::uint64_t>& sample_offsets(void) const { return this->sample_offsets_; }
+        const std::vector<TimeRun>& time_runs(void) const { return this->time_runs_; }
+
+        SampleInfo sample(std::size_t index) const {
+            SampleInfo info;
+            info.offset = this->sample_offsets_[index];
+            info.size = this->sample_sizes_[index];
+            const TimeRun& run = this->find_run(index);
+            info.timestamp = run.first_time + std::uint64_t(index - run.first_sample) * run.duration;
+            info.duration = run.duration;
+            return info;
+        }
+        // Returns the index of the sample whose decode time covers time, or sample_count() if time is past the end.
+        // Constant sample durations are resolved in O(1), other layouts by a binary search over the time runs.
+        std::size_t find_sample(std::uint64_t time) const {
+            const TimeRun* run = &this->time_runs_.front();
+            if(time >= run->first_time + std::uint64_t(run->count) * run->duration) {
+                auto it = std::upper_bound(this->time_runs_.begin(), this->time_runs_.end(), time, [](std::uint64_t t, const TimeRun& r) {
+                    return t < r.first_time;
+                });
+                run = &*(it - 1);
+            }
+            if(run->duration == 0) return run->first_sample;
+            std::uint64_t index = run->first_sample + (time - run->first_time) / run->duration;
+            return index < this->sample_count() ? std::size_t(index) : this->sample_count();
+        }
+    private:
+        bool fail(ReadError error) {
+            this->error_ = error;
+            return false;
+        }
+
+        // Calls f(type, payload, payload_size) for each box in data. Returns false if a box is truncated.
+        template<typename F>
+        static bool for_each_box(const u8* data, std::size_t size, F&& f) {
+            while(size >= sizeof(AtomHeader)) {
+                AtomHeader header;
+                read(data, size, header);
+                std::uint64_t box_size = std::uint32_t(header.size);
+                std::size_t header_size = sizeof(AtomHeader);
+                if(box_size == 1) {
+                    u64 largesize;
+                    if(!read(data + header_size, size - header_size, largesize)) return false;
+                    box_size = largesize;
+                    header_size += sizeof(u64);
+                }
+                else if(box_size == 0) {
+                    box_size = size;
+                }
+                if(box_size < header_size || box_size > size) return false;
+                if(!f(header.type, data + header_size, std::size_t(box_size - header_size))) return false;
+                data += box_size;
+                size -= box_size;
+            }
+            return true;
+        }
+
+        // Finds the first child box of the given type.
+        static bool find_box(const u8* data, std::size_t size, const char* type, const u8*& payload, std::size_t& payload_size) {
+            bool found = false;
+            for_each_box(data, size, [&](const BoxType& box_type, const u8* box_payload, std::size_t box_payload_size) {
+                if(box_type == BoxType(type)) {
+                    payload = box_payload;
+                    payload_size = box_payload_size;
+                    found = true;
+                    return false;
+                }
+                return true;
+            });
+            return found;
+        }
+
+        static std::uint32_t read_u32(const u8* data) {
+            u32 value;
+            std::memcpy(&value, data, sizeof(value));
+            return value;
+        }
+        static std::uint64_t read_u64(const u8* data) {
+            u64 value;
+            std::memcpy(&value, data, sizeof(value));
+            return value;
+        }
+
+        bool parse_moov(const u8* data, std::size_t size, std::size_t track_index) {
+            std::uint32_t movie_timescale = 0;
+            const u8* mvhd; std::size_t mvhd_size;
+            if(find_box(data, size, MvhdAtom::TYPE, mvhd, mvhd_size) && mvhd_size >= 24) {
+                // Version 1 has 64-bit times.
+                movie_timescale = read_u32(mvhd + (mvhd[0] == 1 ? 20 : 12));
+            }
+            bool found = false;
+            bool malformed = false;
+            for_each_box(data, size, [&](const BoxType& type, const u8* payload, std::size_t payload_size) {
+                if(type != BoxType(TrakBox::TYPE)) return true;
+                Reader track;
+                if(track.parse_trak(payload, payload_size)) {
+                    if(track_index-- > 0) return true;
+                    track.mdat_offset_ = this->mdat_offset_;
+                    track.mdat_size_ = this->mdat_size_;
+                    track.movie_timescale_ = movie_timescale;
+                    *this = std::move(track);
+                    found = true;
+                    return false;
+                }
+                malformed = malformed || track.error_ == ReadError::Malformed;
+                return true;
+            });
+            if(found) return true;
+            return this->fail(malformed ? ReadError::Malformed : ReadError::NoTrack);
+        }
+
+        bool parse_trak(const u8* data, std::size_t size) {
+            const u8* mdia; std::size_t mdia_size;
+            const u8* minf; std::size_t minf_size;
+            const u8* stbl; std::size_t stbl_size;
+            if(!find_box(data, size, MdiaBox::TYPE, mdia, mdia_size)
+            || !find_box(mdia, mdia_size, MinfBox::TYPE, minf, minf_size)
+            || !find_box(minf, minf_size, StblBox::TYPE, stbl, stbl_size)) {
+                return this->fail(ReadError::NoTrack);
+            }
+            if(!this->parse_stsd(stbl, stbl_size)) return false;
+
+            const u8* payload; std::size_t payload_size;
+            if(!find_box(mdia, mdia_size, MdhdAtom::TYPE, payload, payload_size)) return this->fail(ReadError::Malformed);
+            if(payload_size < 24) return this->fail(ReadError::Malformed);
+            if(payload[0] == 1) {
+                // Version 1 has 64-bit times.
+                if(payload_size < 32) return this->fail(ReadError::Malformed);
+                this->timescale_ = read_u32(payload + 20);
+                this->duration_ = read_u64(payload + 24);
+            }
+            else {
+                this->timescale_ = read_u32(payload + 12);
+                this->duration_ = read_u32(payload + 16);
+            }
+
+            const u8* edts; std::size_t edts_size;
+            if(find_box(data, size, EdtsBox::TYPE, edts, edts_size) && find_box(edts, edts_size, ElstAtom::TYPE, payload, payload_size) && payload_size >= 8 && read_u32(payload + 4) > 0) {
+                if(payload[0] == 1) {
+                    if(payload_size >= 28) {
+                        this->edit_duration_ = read_u64(payload + 8);
+                        this->media_time_ = read_u64(payload + 16);
+                    }
+                }
+                else if(payload_size >= 20) {
+                    this->edit_duration_ = read_u32(payload + 8);
+                    this->media_time_ = read_u32(payload + 12);
+                }
+            }
+            return this->parse_sample_tables(stbl, stbl_size);
+        }
+
+        bool parse_stsd(const u8* stbl, std::size_t stbl_size) {
+            const u8* stsd; std::size_t stsd_size;
+            const std::size_t stsd_fields = sizeof(StsdBox::StsdHeader) - sizeof(AtomHeader);
+            if(!find_box(stbl, stbl_size, StsdBox::TYPE, stsd, stsd_size) || stsd_size < stsd_fields) return this->fail(ReadError::NoTrack);
+
+            const u8* entry; std::size_t entry_size;
+            const std::size_t entry_fields = sizeof(StsdBox::SampleDescriptionEntryHeader) - sizeof(AtomHeader);
+            if(!find_box(stsd + stsd_fields, stsd_size - stsd_fields, StsdBox::SampleDescriptionEntry::TYPE, entry, entry_size) || entry_size < entry_fields) {
+                return this->fail(ReadError::NoTrack);
+            }
+            StsdBox::SampleDescriptionEntryHeader header;
+            std::memcpy(reinterpret_cast<u8*>(&header) + sizeof(AtomHeader), entry, entry_fields);
+            this->number_of_channels_ = header.number_of_channels;
+            this->sample_rate_ = std::uint32_t(header.sample_rate) >> 16;
+
+            const u8* esds; std::size_t esds_size;
+            if(!find_box(entry + entry_fields, entry_size - entry_fields, EsdsAtom::TYPE, esds, esds_size) || esds_size < 4) {
+                return this->fail(ReadError::Malformed);
+            }
+            return this->parse_descriptors(esds + 4, esds_size - 4) || this->fail(ReadError::Malformed);
+        }
+
+        // Walks the ES descriptor down to the decoder specific info.
+        bool parse_descriptors(const u8* data, std::size_t size) {
+            while(size >= 2) {
+                const u8 tag = data[0];
+                std::size_t length = 0;
+                std::size_t header_size = 1;
+                do {
+                    if(header_size >= size || header_size > 4) return false;
+                    length = (length << 7) | (data[header_size] & 0x7f);
+                } while(data[header_size++] & 0x80);
+                if(length > size - header_size) return false;
+                const u8* body = data + header_size;
+                switch(tag) {
+                case EsdsAtom::TAG_ES_DESCRIPTOR: {
+                    if(length < 3) return false;
+                    std::size_t skip = 3;
+                    const u8 flags = body[2];
+                    if(flags & 0x80) skip += 2;                                // dependsOn_ES_ID
+                    if(flags & 0x40) skip += 1 + (skip < length ? body[skip] : 0);  // URL
+                    if(flags & 0x20) skip += 2;                                // OCR_ES_Id
+                    return skip <= length && this->parse_descriptors(body + skip, length - skip);
+                }
+                case EsdsAtom::TAG_DECODER_CONFIG:
+                    return length >= 13 && this->parse_descriptors(body + 13, length - 13);
+                case EsdsAtom::TAG_DECODER_SPECIFIC:
+                    this->audio_specific_config_.assign(body, body + length);
+                    return true;
+                default:
+                    break;
+                }
+                data = body + length;
+                size -= header_size + length;
+            }
+            return false;
+        }
+
+        bool parse_sample_tables(const u8* stbl, std::size_t stbl_size) {
+            const u8* payload; std::size_t payload_size;
+
+            // stsz or stz2
+            bool compact = false;
+            if(!find_box(stbl, stbl_size, StszBox::TYPE, payload, payload_size)) {
+                if(!find_box(stbl, stbl_size, StszBox::TYPE_COMPACT, payload, payload_size)) return this->fail(ReadError::Malformed);
+                compact = true;
+            }
+            if(payload_size < 12) return this->fail(ReadError::Malformed);
+            const std::uint32_t sample_size = read_u32(payload + 4);
+            const std::uint32_t number_of_samples = read_u32(payload + 8);
+            if(!compact && sample_size != 0) {
+                this->sample_sizes_.assign(number_of_samples, sample_size);
+            }
+            else {
+                const std::uint32_t field_size = compact ? sample_size & 0xff : 32;
+                if(field_size != 4 && field_size != 8 && field_size != 16 && field_size != 32) return this->fail(ReadError::Malformed);
+                if((std::uint64_t(payload_size) - 12) * 8 / field_size < number_of_samples) return this->fail(ReadError::Malformed);
+                this->sample_sizes_.resize(number_of_samples);
+                const u8* entries = payload + 12;
+                for(std::uint32_t i = 0; i < number_of_samples; i++) {
+                    switch(field_size) {
+                    case 4:  this->sample_sizes_[i] = (entries[i / 2] >> (i % 2 == 0 ? 4 : 0)) & 0x0f; break;
+                    case 8:  this->sample_sizes_[i] = entries[i]; break;
+                    case 16: this->sample_sizes_[i] = (std::uint32_t(entries[i * 2]) << 8) | entries[i * 2 + 1]; break;
+                    default: this->sample_sizes_[i] = read_u32(entries + i * 4); break;
+                    }
+                }
+            }
+
+            // stco or co64
+            std::vector<std::uint64_t> chunk_offsets;
+            bool large = false;
+            if(!find_box(stbl, stbl_size, StcoAtom::TYPE, payload, payload_size)) {
+                if(!find_box(stbl, stbl_size, StcoAtom::TYPE_64, payload, payload_size)) return this->fail(ReadError::Malformed);
+                large = true;
+            }
+            if(payload_size < 8) return this->fail(ReadError::Malformed);
+            const std::uint32_t number_of_chunks = read_u32(payload + 4);
+            const std::size_t offset_size = large ? 8 : 4;
+            if((payload_size - 8) / offset_size < number_of_chunks) return this->fail(ReadError::Malformed);
+            chunk_offsets.resize(number_of_chunks);
+            for(std::uint32_t i = 0; i < number_of_chunks; i++) {
+                chunk_offsets[i] = large ? read_u64(payload + 8 + i * 8) : read_u32(payload + 8 + i * 4);
+            }
+
+            // stsc: expand the chunks into per-sample offsets
+            if(!find_box(stbl, stbl_size, StscAtom::TYPE, payload, payload_size) || payload_size < 8) return this->fail(ReadError::Malformed);
+            const std::uint32_t number_of_runs = read_u32(payload + 4);
+            if((payload_size - 8) / sizeof(StscAtom::StscEntry) < number_of_runs) return this->fail(ReadError::Malformed);
+            this->sample_offsets_.resize(number_of_samples);
+            std::uint32_t sample = 0;
+            for(std::uint32_t run = 0; run < number_of_runs && sample < number_of_samples; run++) {
+                StscAtom::StscEntry entry;
+                read(payload + 8 + run * sizeof(entry), sizeof(entry), entry);
+                // The runs must start at the first chunk and their first chunks must strictly increase.
+                std::uint32_t first_chunk = entry.first_chunk;
+                std::uint32_t last_chunk = number_of_chunks;
+                if(run == 0 && first_chunk != 1) return this->fail(ReadError::Malformed);
+                if(run + 1 < number_of_runs) {
+                    const std::uint32_t next_first_chunk = read_u32(payload + 8 + (run + 1) * sizeof(entry));
+                    if(next_first_chunk <= first_chunk) return this->fail(ReadError::Malformed);
+                    last_chunk = next_first_chunk - 1;
+                }
+                if(last_chunk > number_of_chunks) return this->fail(ReadError::Malformed);
+                for(std::uint32_t chunk = first_chunk; chunk <= last_chunk && sample < number_of_samples; chunk++) {
+                    std::uint64_t offset = chunk_offsets[chunk - 1];
+                    for(std::uint32_t i = 0; i < entry.samples_per_chunk && sample < number_of_samples; i++, sample++) {
+                        this->sample_offsets_[sample] = offset;
+                        offset += this->sample_sizes_[sample];
+                    }
+                }
+            }
+            if(sample != number_of_samples) return this->fail(ReadError::Malformed);
+
+            // stts
+            if(!find_box(stbl, stbl_size, SttsAtom::TYPE, payload, payload_size) || payload_size < 8) return this->fail(ReadError::Malformed);
+            const std::uint32_t number_of_time_runs = read_u32(payload + 4);
+            if((payload_size - 8) / sizeof(SttsAtom::SttsEntry) < number_of_time_runs) return this->fail(ReadError::Malformed);
+            TimeRun current = {0, 0, 0, 0};
+            for(std::uint32_t i = 0; i < number_of_time_runs; i++) {
+                SttsAtom::SttsEntry entry;
+                read(payload + 8 + i * sizeof(entry), sizeof(entry), entry);
+                if(std::uint32_t(entry.count) == 0) continue;
+                current.count = entry.count;
+                current.duration = entry.duration;
+                this->time_runs_.push_back(current);
+                current.first_sample += current.count;
+                current.first_time += std::uint64_t(current.count) * current.duration;
+            }
+            if(this->time_runs_.empty()) {
+                this->time_runs_.push_back(TimeRun{0, 0, 0, 0});
+            }
+            return true;
+        }
+
+        // Finds the time run holding the sample. Samples beyond the table use the last run.
+        const TimeRun& find_run(std::size_t index) const {
+            auto it = std::upper_bound(this->time_runs_.begin(), this->time_runs_.end(), index, [](std::size_t i, const TimeRun& run) {
+                return i < run.first_sample;
+            });
+            return *(it == this->time_runs_.begin() ? it : it - 1);
+        }
+
+        ReadError error_ = ReadError::None;
+        std::uint32_t timescale_ = 0;
+        std::uint64_t duration_ = 0;
+        std::uint32_t sample_rate_ = 0;
+        std::uint16_t number_of_channels_ = 0;
+        std::uint64_t media_time_ = 0;
+        std::uint64_t edit_duration_ = 0;
+        std::uint32_t movie_timescale_ = 0;
+        std::uint64_t mdat_offset_ = 0;
+        std::uint64_t mdat_size_ = 0;
+        std::vector<u8> audio_specific_config_;
+        std::vector<std::uint32_t> sample_sizes_;
+        std::vector<std::uint64_t> sample_offsets_;
+        std::vector<TimeRun> time_runs_;
+    };
+
+#ifdef AACMP4_HAS_MAPPED_READER
+    // Maps a whole MP4 file read-only and gives views of its frames without copying them.
+    class MappedReader {
+    public:
+        MappedReader() = default;
+        ~MappedReader() { this->close(); }
+        MappedReader(const MappedReader&) = delete;
+        MappedReader& operator=(const MappedReader&) = delete;
+
+        bool open(const char* path, std::size_t track = 0) {
+            this->close();
+            int fd = ::open(path, O_RDONLY);
+            if(fd < 0) return false;
+            struct stat st;
+            if(::fstat(fd, &st) != 0 || st.st_size == 0) {
+                ::close(fd);
+                return false;
+            }
+            void* mapping = ::mmap(nullptr, std::size_t(st.st_size), PROT_READ, MAP_SHARED, fd, 0);
+            ::close(fd);
+            if(mapping == MAP_FAILED) return false;
+            this->base = static_cast<const u8*>(mapping);
+            this->size = std::size_t(st.st_size);
+            ::madvise(mapping, this->size, MADV_RANDOM);
+
+            if(!this->reader_.open(this->base, this->size, track)) {
+                this->close();
+                return false;
+            }
+            // Reject tables pointing outside of the file so that frame() needs no checks.
+            for(std::size_t i = 0; i < this->reader_.sample_count(); i++) {
+                const std::uint64_t offset = this->reader_.sample_offsets()[i];
+                if(offset > this->size || this->reader_.sample_sizes()[i] > this->size - offset) {
+                    this->close();
+                    return false;
+                }
+            }
+            return true;
+        }
+
+        void close(void) {
+            if(this->base == nullptr) return;
+            ::munmap(const_cast<u8*>(this->base), this->size);
+            this->base = nullptr;
+            this->size = 0;
+        }
+
+        const Reader& reader(void) const { return this->reader_; }
+
+        // View of the frame in the mapping. Valid until close().
+        Segment frame(std::size_t index) const {
+            return Segment{this->base + this->reader_.sample_offsets()[index], this->reader_.sample_sizes()[index]};
+        }
+    private:
+        Reader reader_;
+        const u8* base = nullptr;
+        std::size_t size = 0;
+    };
+#endif
+} // namespace AACMP4
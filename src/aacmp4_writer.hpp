@@ -0,0 +1,423 @@
+// SPDX-License-Identifier: BSL-1.0
+// Copyright Kenta Ida 2023.
+// Distributed under the Boost Software License, Version 1.0.
+//    (See accompanying file LICENSE_1_0.txt or copy at
+//          https://www.boost.org/LICENSE_1_0.txt)
+
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <type_traits>
+#include <vector>
+
+#include "aacmp4.hpp"
+#include "aacmp4_journal.hpp"
+#include "durable_sink.hpp"
+#include "stream_adapter.hpp"
+
+namespace AACMP4 {
+    // Decides how the frames are grouped into chunks.
+    // A chunk is closed when either limit is reached. With both limits zero, all frames go into one chunk.
+    struct ChunkPolicy {
+        // Maximum number of frames per chunk. 0 means no limit.
+        std::uint32_t samples_per_chunk = 0;
+        // Maximum duration of a chunk. 0 means no limit.
+        std::uint32_t chunk_duration_ms = 0;
+    };
+
+    struct WriterConfig {
+        ChunkPolicy chunk_policy;
+        // Expected duration of the recording. If non-zero, space for moov is reserved in front of mdat
+        // so that moov can be written at the head of the file (faststart).
+        std::uint32_t faststart_duration_ms = 0;
+        // Block size used to shift the payload when moov does not fit in the reserved space.
+        std::size_t relocation_block_size = 1024 * 1024;
+        // Write the sample sizes as stz2 with 8 or 16 bit entries when every frame fits.
+        // Not all players support stz2.
+        bool compact_sample_sizes = false;
+        // With SpillStorage (spill_table.hpp), the sidecar file for the sample sizes
+        // and the number of sizes kept in memory.
+        const char* sample_size_spill_path = nullptr;
+        std::size_t sample_size_window = 4096;
+#ifdef AACMP4_HAS_FRAME_JOURNAL
+        // If set, the frame sizes are journaled so that recover_aac_mp4() can rebuild moov after a crash.
+        // The journal must be opened and must outlive the writer.
+        FrameJournal* journal = nullptr;
+#endif
+    };
+
+    // Writes an AAC MP4 file incrementally.
+    // ftyp and an open mdat are written on construction, the frames are appended to the mdat as they arrive,
+    // and moov is written by finalize(). Only the sample tables are kept in memory.
+    // The stream must provide write(), position() and write_at() like StreamAdapter.
+    //
+    // With faststart enabled, moov is written into the space reserved in front of mdat.
+    // If it does not fit and the stream provides read_at(), the payload is shifted to make room for it.
+    // Otherwise moov is written after mdat.
+    //
+    // Storage selects where the sample tables are kept (see storage.hpp). With StaticStorage or ArenaStorage
+    // the writer does not allocate from the heap after construction, and a frame which does not fit in the
+    // tables is rejected and reported by capacity_exhausted().
+    template<typename S, typename Storage = HeapStorage>
+    class AacMp4Writer {
+    public:
+        AacMp4Writer(S& stream, std::uint32_t sample_rate, std::uint32_t samples_per_frame = 1024, std::uint16_t number_of_channels = 1, const WriterConfig& config = WriterConfig())
+            : stream(stream), sample_rate(sample_rate), samples_per_frame(samples_per_frame), relocation_block_size(config.relocation_block_size)
+        {
+            this->set_chunk_policy(config.chunk_policy);
+            this->start(number_of_channels, config);
+        }
+
+        // With ArenaStorage, allocates the sample tables for up to max_frames frames from the arena.
+        AacMp4Writer(S& stream, Arena& arena, std::size_t max_frames, std::uint32_t sample_rate, std::uint32_t samples_per_frame = 1024, std::uint16_t number_of_channels = 1, const WriterConfig& config = WriterConfig())
+            : stream(stream), sample_rate(sample_rate), samples_per_frame(samples_per_frame), relocation_block_size(config.relocation_block_size)
+        {
+            static_assert(std::is_same<Storage, ArenaStorage>::value, "an arena is used only with ArenaStorage");
+            this->set_chunk_policy(config.chunk_policy);
+            const std::size_t max_chunks = this->frames_per_chunk > 0 ? (max_frames + this->frames_per_chunk - 1) / this->frames_per_chunk : 1;
+            this->capacity_exhausted_ = !allocate_tables(this->moov, arena, max_frames, max_chunks);
+            this->start(number_of_channels, config);
+        }
+
+        // Appends an encoded AAC frame. Returns false if the sample tables are full.
+        bool add_frame(const u8* data, std::size_t size) {
+            if(!this->reserve_frames(1)) return false;
+            AACMP4::write(this->stream, data, size);
+            this->append_sample(std::uint32_t(size));
+            return true;
+        }
+
+        // Appends count frames stored back to back in data.
+        // Returns false without writing any of them if the sample tables cannot hold all of them.
+        // T is std::uint32_t or std::uint16_t. The sizes are converted to the stsz table in bulk.
+        template<typename T>
+        bool add_frames(const u8* data, const T* sizes, std::size_t count) {
+            if(!this->reserve_frames(count)) return false;
+            // An empty batch must not open a chunk, which would stay empty.
+            if(count == 0) return true;
+            this->journal_frames(sizes, count);
+            const SampleSizeStats stats = this->moov.trak.mdia.minf.stbl.stsz.append(sizes, count);
+            AACMP4::write(this->stream, data, stats.total_size);
+            this->stats.merge(stats);
+            if(this->frames_per_chunk == 0) {
+                // All frames go into one chunk, so the chunk boundaries need no per-frame work.
+                this->open_chunk();
+                this->frames_in_chunk += count;
+                this->payload_size += stats.total_size;
+                return true;
+            }
+            for(std::size_t i = 0; i < count; i++) {
+                this->advance_chunk(sizes[i]);
+            }
+            return true;
+        }
+
+        // Returns the place in the output where the next frame of up to max_size bytes can be encoded in place,
+        // or nullptr if the sample tables are full.
+        // Available if the stream provides acquire() and commit() like MmapSink.
+        u8* acquire_frame(std::size_t max_size) {
+            if(!this->reserve_frames(1)) return nullptr;
+            return this->stream.acquire(max_size);
+        }
+        // Appends the frame of size bytes encoded into the place returned by acquire_frame().
+        void commit_frame(std::size_t size) {
+            this->stream.commit(size);
+            this->append_sample(std::uint32_t(size));
+        }
+
+        // Replaces the AudioSpecificConfig derived from the constructor arguments, e.g. with one built from
+        // an ADTS header of a profile other than AAC-LC. Must be called before finalize().
+        void set_audio_specific_config(const u8 (&config)[5]) {
+            for(auto& entry : this->moov.trak.mdia.minf.stbl.stsd.sample_description_entries) {
+                std::memcpy(entry.esds.desc.decoder_config.decoder_specific.specific, config, sizeof(config));
+            }
+        }
+
+        // True if a frame has been rejected, or the tables could not be allocated, because of the storage capacity.
+        bool capacity_exhausted(void) const { return this->capacity_exhausted_; }
+
+        // Position of the first payload byte.
+        std::uint64_t payload_position(void) const { return this->mdat_position + 2 * sizeof(AtomHeader); }
+
+        std::size_t number_of_frames(void) const { return this->moov.trak.mdia.minf.stbl.stsz.entries.size(); }
+
+        // Upper bound of the moov size for a recording of the given duration.
+        std::uint64_t estimate_moov_size(std::uint32_t duration_ms) {
+            std::uint64_t frames = (std::uint64_t(duration_ms) * this->sample_rate / 1000 + this->samples_per_frame - 1) / this->samples_per_frame;
+            std::uint64_t chunks = this->frames_per_chunk > 0 ? (frames + this->frames_per_chunk - 1) / this->frames_per_chunk : 1;
+            this->moov.compute();
+            return std::uint32_t(this->moov.header.size)
+                + 2 * sizeof(SttsAtom::SttsEntry)   // constant duration and the remainder
+                + 2 * sizeof(StscAtom::StscEntry)   // full chunks and the last chunk
+                + frames * sizeof(u32)              // stsz entries
+                + chunks * sizeof(u64);             // co64 entries
+        }
+
+        // Completes the file assuming every frame holds samples_per_frame samples.
+        bool finalize(void) {
+            return this->finalize(std::uint64_t(this->number_of_frames()) * this->samples_per_frame);
+        }
+
+        // Completes the file. number_of_samples is the number of PCM samples fed to the encoder.
+        // Returns false if the file is not playable: moov is not written if the duration does not fit
+        // the 32-bit movie durations (see fits_movie_duration()), and stsz is incomplete if a spilled
+        // sample size table could not be written or read back.
+        bool finalize(std::uint64_t number_of_samples) {
+            if(this->finalized) return this->completed;
+            this->finalized = true;
+            this->journal_flush();
+            if(!fits_movie_duration(this->sample_rate, number_of_samples)) return false;
+
+            u64 largesize;
+            RefMdatBox::compute_header(this->mdat_header, largesize, this->payload_size);
+            if(this->mdat_header.size == 1) {
+                // Overwrite the placeholder and the mdat header with a 64-bit mdat header.
+                u8 header[sizeof(AtomHeader) + sizeof(u64)];
+                std::memcpy(header, &this->mdat_header, sizeof(AtomHeader));
+                std::memcpy(header + sizeof(AtomHeader), &largesize, sizeof(u64));
+                this->stream.write_at(this->mdat_position, header, sizeof(header));
+            }
+            else {
+                this->stream.write_at(this->mdat_position + sizeof(AtomHeader), this->mdat_header.size.octets, sizeof(this->mdat_header.size));
+            }
+
+            set_moov_duration(this->moov, this->sample_rate, number_of_samples, this->samples_per_frame);
+            set_bit_rates(this->moov, this->stats, this->sample_rate, this->samples_per_frame);
+            this->close_chunk();
+            this->moov.compute();
+
+            this->place_moov();
+            this->completed = this->sample_sizes_complete();
+            return this->completed;
+        }
+    private:
+        void set_chunk_policy(const ChunkPolicy& policy) {
+            this->frames_per_chunk = policy.samples_per_chunk;
+            if(policy.chunk_duration_ms > 0) {
+                std::uint32_t frames = std::uint64_t(policy.chunk_duration_ms) * this->sample_rate / 1000 / this->samples_per_frame;
+                frames = frames > 0 ? frames : 1;
+                if(this->frames_per_chunk == 0 || frames < this->frames_per_chunk) {
+                    this->frames_per_chunk = frames;
+                }
+            }
+        }
+
+        // Writes ftyp, the space reserved for moov and the open mdat.
+        void start(std::uint16_t number_of_channels, const WriterConfig& config) {
+            FtypAtom ftyp;
+            setup_ftyp(ftyp);
+            AACMP4::write(this->stream, ftyp);
+
+            setup_moov(this->moov, this->sample_rate, number_of_channels);
+            this->moov.trak.mdia.minf.stbl.stsz.compact = config.compact_sample_sizes;
+            if constexpr (has_for_each_block<decltype(this->moov.trak.mdia.minf.stbl.stsz.entries)>::value) {
+                if(config.sample_size_spill_path == nullptr || !this->moov.trak.mdia.minf.stbl.stsz.entries.open(config.sample_size_spill_path, config.sample_size_window)) {
+                    this->capacity_exhausted_ = true;
+                }
+            }
+
+            this->moov_position = this->stream.position();
+            if(config.faststart_duration_ms > 0) {
+                FreeBox reserved;
+                reserved.padding = std::uint32_t(this->estimate_moov_size(config.faststart_duration_ms));
+                reserved.compute();
+                AACMP4::write(this->stream, reserved);
+                this->reserved_size = std::uint32_t(reserved.header.size);
+            }
+
+            // The mdat size is patched by finalize().
+            // An empty free box is placed in front of the mdat header so that the header can be widened
+            // to the 64-bit largesize form in place if the payload exceeds 4GiB.
+            FreeBox placeholder;
+            placeholder.compute();
+            this->mdat_position = this->stream.position();
+            AACMP4::write(this->stream, placeholder);
+            this->mdat_header.size = 0;
+            this->mdat_header.type = RefMdatBox::TYPE;
+            AACMP4::write(this->stream, this->mdat_header);
+
+#ifdef AACMP4_HAS_FRAME_JOURNAL
+            this->journal = config.journal;
+            if(this->journal != nullptr) {
+                this->journal->begin(this->sample_rate, this->samples_per_frame, number_of_channels, this->payload_position());
+            }
+#endif
+        }
+
+        // Checks that count more frames, and the chunks opened for them, fit in the sample tables.
+        bool reserve_frames(std::size_t count) {
+            const auto& stbl = this->moov.trak.mdia.minf.stbl;
+            const std::size_t chunks = this->frames_per_chunk > 0
+                ? (this->frames_in_chunk + count + this->frames_per_chunk - 1) / this->frames_per_chunk - (this->frames_in_chunk > 0 ? 1 : 0)
+                : (stbl.stco.entries.empty() ? 1 : 0);
+            if(count > stbl.stsz.entries.max_size() - stbl.stsz.entries.size()
+            || chunks > stbl.stco.entries.max_size() - stbl.stco.entries.size()) {
+                this->capacity_exhausted_ = true;
+                return false;
+            }
+            return true;
+        }
+
+        template<typename T>
+        void journal_frames(const T* sizes, std::size_t count) {
+#ifdef AACMP4_HAS_FRAME_JOURNAL
+            if(this->journal != nullptr) {
+                this->journal->add(sizes, count);
+            }
+#else
+            (void)sizes;
+            (void)count;
+#endif
+        }
+        void journal_flush(void) {
+#ifdef AACMP4_HAS_FRAME_JOURNAL
+            if(this->journal != nullptr) {
+                this->journal->flush();
+            }
+#endif
+        }
+
+        void append_sample(std::uint32_t size) {
+            this->journal_frames(&size, 1);
+            this->moov.trak.mdia.minf.stbl.stsz.entries.push_back(size);
+            SampleSizeStats stats;
+            stats.total_size = size;
+            stats.max_size = size;
+            stats.count = 1;
+            this->stats.merge(stats);
+            this->advance_chunk(size);
+        }
+
+        void open_chunk(void) {
+            if(this->frames_in_chunk == 0) {
+                this->moov.trak.mdia.minf.stbl.stco.entries.push_back(this->payload_position() + this->payload_size);
+            }
+        }
+
+        // Accounts a frame already added to stsz to the current chunk.
+        void advance_chunk(std::uint32_t size) {
+            this->open_chunk();
+            this->payload_size += size;
+            this->frames_in_chunk++;
+            if(this->frames_in_chunk == this->frames_per_chunk) {
+                this->close_chunk();
+            }
+        }
+
+        void close_chunk(void) {
+            if(this->frames_in_chunk == 0) return;
+            auto& stbl = this->moov.trak.mdia.minf.stbl;
+            if(!stbl.stsc.add_chunk(stbl.stco.entries.size(), this->frames_in_chunk)) {
+                this->capacity_exhausted_ = true;
+            }
+            this->frames_in_chunk = 0;
+            mark_fragment_boundary(this->stream);
+        }
+
+        // Writes moov into the reserved space, or after mdat without faststart.
+        void place_moov(void) {
+            if(this->reserved_size == 0) {
+                this->moov.write(this->stream);
+                return;
+            }
+            const std::uint32_t moov_size = this->moov.header.size;
+            if(moov_size <= this->reserved_size) {
+                const std::uint32_t rest_size = this->reserved_size - moov_size;
+                if(rest_size == 0 || rest_size >= sizeof(AtomHeader)) {
+                    this->write_moov_at(this->moov_position);
+                    this->write_free_header_at(this->moov_position + moov_size, rest_size);
+                    return;
+                }
+                if(this->mdat_header.size != 1) {
+                    // The rest is too small for a box header. Cover it and the unused placeholder with one free box.
+                    this->write_moov_at(this->moov_position);
+                    this->write_free_header_at(this->moov_position + moov_size, rest_size + sizeof(AtomHeader));
+                    return;
+                }
+                // The placeholder holds the largesize. Move the payload forward to make room for a free box instead.
+                this->relocate_payload(sizeof(AtomHeader));
+                return;
+            }
+            this->relocate_payload(0);
+        }
+
+        // False if a spilled sample size table failed, so that stsz may hold zeros or miss frames written to mdat.
+        bool sample_sizes_complete(void) const {
+            if constexpr (has_for_each_block<decltype(this->moov.trak.mdia.minf.stbl.stsz.entries)>::value) {
+                return this->moov.trak.mdia.minf.stbl.stsz.entries.error() == 0;
+            }
+            else {
+                return true;
+            }
+        }
+
+        void write_moov_at(std::uint64_t position) {
+            PositionedStream<S> positioned(this->stream, position);
+            this->moov.write(positioned);
+        }
+
+        // Writes the header of a free box of size bytes at position. Nothing is written if size is 0.
+        void write_free_header_at(std::uint64_t position, std::uint32_t size) {
+            if(size == 0) return;
+            FreeBox free;
+            free.padding = size - sizeof(AtomHeader);
+            free.compute();
+            this->stream.write_at(position, reinterpret_cast<const u8*>(&free.header), sizeof(free.header));
+        }
+
+        // Moves the placeholder, the mdat header and the payload forward so that moov, followed by a free box
+        // of free_size bytes, fits in front of them. The payload only ever moves towards the end of the file.
+        void relocate_payload(std::uint32_t free_size) {
+            if constexpr (has_read_at<S>::value) {
+                for(auto& offset : this->moov.trak.mdia.minf.stbl.stco.entries) {
+                    offset -= this->payload_position();
+                }
+                const std::uint64_t old_payload_position = this->payload_position();
+                const std::uint64_t new_payload_position = relocate_chunk_offsets(this->moov, this->moov_position, free_size + 2 * sizeof(AtomHeader));
+                const std::uint64_t shift = new_payload_position - old_payload_position;
+
+                // Copy from the tail so that the source is not overwritten before it is read.
+                // Without heap allocation, the payload is moved through a small buffer on the stack.
+                std::vector<u8> heap_block(Storage::allocates ? this->relocation_block_size : 0);
+                u8 stack_block[Storage::allocates ? 1 : 1024];
+                u8* block = Storage::allocates ? heap_block.data() : stack_block;
+                const std::size_t block_size = Storage::allocates ? heap_block.size() : sizeof(stack_block);
+                std::uint64_t remaining = this->payload_size + 2 * sizeof(AtomHeader);
+                while(remaining > 0) {
+                    std::size_t bytes_to_copy = remaining < block_size ? remaining : block_size;
+                    remaining -= bytes_to_copy;
+                    this->stream.read_at(this->mdat_position + remaining, block, bytes_to_copy);
+                    this->stream.write_at(this->mdat_position + shift + remaining, block, bytes_to_copy);
+                }
+                this->mdat_position += shift;
+                this->write_moov_at(this->moov_position);
+                this->write_free_header_at(this->moov_position + std::uint32_t(this->moov.header.size), free_size);
+            }
+            else {
+                // The payload cannot be moved. Leave the reserved space as it is and write moov at the end.
+                this->moov.write(this->stream);
+            }
+        }
+
+        S& stream;
+        std::uint32_t sample_rate;
+        std::uint32_t samples_per_frame;
+        std::size_t relocation_block_size;
+        BasicMoovBox<Storage> moov;
+        AtomHeader mdat_header;
+        std::uint64_t moov_position = 0;
+        std::uint32_t reserved_size = 0;
+        std::uint64_t mdat_position = 0;
+        std::uint64_t payload_size = 0;
+        SampleSizeStats stats;
+        std::uint32_t frames_per_chunk = 0;
+        std::uint32_t frames_in_chunk = 0;
+        bool finalized = false;
+        bool completed = false;
+        bool capacity_exhausted_ = false;
+#ifdef AACMP4_HAS_FRAME_JOURNAL
+        FrameJournal* journal = nullptr;
+#endif
+    };
+} // namespace AACMP4
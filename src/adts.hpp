@@ -0,0 +1,255 @@
+// SPDX-License-Identifier: BSL-1.0
+// Copyright Kenta Ida 2023.
+// Distributed under the Boost Software License, Version 1.0.
+//    (See accompanying file LICENSE_1_0.txt or copy at
+//          https://www.boost.org/LICENSE_1_0.txt)
+
+#pragma once
+
+#include <cstdint>
+#include <optional>
+
+#include "aacmp4.hpp"
+#include "aacmp4_writer.hpp"
+
+#if defined(__AVX2__) || defined(__SSE2__)
+#include <immintrin.h>
+#endif
+#if defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+namespace AACMP4 {
+    // Fields of an ADTS frame header.
+    struct AdtsHeader {
+        static constexpr std::size_t SIZE = 7;
+        static constexpr std::size_t CRC_SIZE = 2;
+
+        std::uint8_t object_type = 0;           // Audio object type (profile + 1), 2 for AAC-LC
+        std::uint8_t frequency_index = 0;
+        std::uint8_t channel_configuration = 0;
+        bool protection_absent = true;
+        std::uint8_t number_of_raw_data_blocks = 1;
+        std::uint16_t frame_length = 0;         // Including the header
+
+        std::size_t header_size(void) const { return SIZE + (this->protection_absent ? 0 : CRC_SIZE); }
+        std::uint32_t sample_rate(void) const { return this->frequency_index < NUMBER_OF_SAMPLE_RATES ? SAMPLE_RATES[this->frequency_index] : 0; }
+        // True if the frame belongs to the same stream as this header.
+        bool same_stream(const AdtsHeader& other) const {
+            return this->object_type == other.object_type
+                && this->frequency_index == other.frequency_index
+                && this->channel_configuration == other.channel_configuration;
+        }
+    };
+
+    // Parses an ADTS header at data. Returns false if there is no syncword, the fields are invalid,
+    // or the header does not fit in size bytes.
+    static bool parse_adts_header(const u8* data, std::size_t size, AdtsHeader& header) {
+        if(size < AdtsHeader::SIZE || data[0] != 0xff || (data[1] & 0xf6) != 0xf0) return false;
+        header.protection_absent = (data[1] & 0x01) != 0;
+        header.object_type = std::uint8_t((data[2] >> 6) + 1);
+        header.frequency_index = std::uint8_t((data[2] >> 2) & 0x0f);
+        header.channel_configuration = std::uint8_t(((data[2] & 0x01) << 2) | (data[3] >> 6));
+        header.frame_length = std::uint16_t(((data[3] & 0x03) << 11) | (data[4] << 3) | (data[5] >> 5));
+        header.number_of_raw_data_blocks = std::uint8_t((data[6] & 0x03) + 1);
+        return header.frequency_index < NUMBER_OF_SAMPLE_RATES
+            && header.frame_length >= header.header_size()
+            && size >= header.header_size();
+    }
+
+    // Returns the offset of the first ADTS syncword (12 set bits followed by layer 0) in data, or size if there is none.
+    // Uses AVX2, SSE2 or NEON if the target supports it.
+    static std::size_t find_adts_syncword(const u8* data, std::size_t size) {
+        std::size_t i = 0;
+#if defined(__AVX2__)
+        {
+            const __m256i all_ones = _mm256_set1_epi8(char(0xff));
+            const __m256i layer_mask = _mm256_set1_epi8(char(0xf6));
+            const __m256i layer_value = _mm256_set1_epi8(char(0xf0));
+            for(; i + 33 <= size; i += 32) {
+                const __m256i first = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(data + i));
+                const __m256i second = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(data + i + 1));
+                const __m256i match = _mm256_and_si256(_mm256_cmpeq_epi8(first, all_ones), _mm256_cmpeq_epi8(_mm256_and_si256(second, layer_mask), layer_value));
+                const std::uint32_t mask = std::uint32_t(_mm256_movemask_epi8(match));
+                if(mask != 0) return i + std::size_t(__builtin_ctz(mask));
+            }
+        }
+#elif defined(__SSE2__)
+        {
+            const __m128i all_ones = _mm_set1_epi8(char(0xff));
+            const __m128i layer_mask = _mm_set1_epi8(char(0xf6));
+            const __m128i layer_value = _mm_set1_epi8(char(0xf0));
+            for(; i + 17 <= size; i += 16) {
+                const __m128i first = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + i));
+                const __m128i second = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + i + 1));
+                const __m128i match = _mm_and_si128(_mm_cmpeq_epi8(first, all_ones), _mm_cmpeq_epi8(_mm_and_si128(second, layer_mask), layer_value));
+                const std::uint32_t mask = std::uint32_t(_mm_movemask_epi8(match));
+                if(mask != 0) return i + std::size_t(__builtin_ctz(mask));
+            }
+        }
+#elif defined(__ARM_NEON)
+        {
+            const uint8x16_t layer_mask = vdupq_n_u8(0xf6);
+            const uint8x16_t layer_value = vdupq_n_u8(0xf0);
+            for(; i + 17 <= size; i += 16) {
+                const uint8x16_t first = vld1q_u8(data + i);
+                const uint8x16_t second = vld1q_u8(data + i + 1);
+                const uint8x16_t match = vandq_u8(vceqq_u8(first, vdupq_n_u8(0xff)), vceqq_u8(vandq_u8(second, layer_mask), layer_value));
+                // Narrow each byte of the comparison to 4 bits of a 64-bit mask.
+                const std::uint64_t mask = vget_lane_u64(vreinterpret_u64_u8(vshrn_n_u16(vreinterpretq_u16_u8(match), 4)), 0);
+                if(mask != 0) return i + std::size_t(__builtin_ctzll(mask) / 4);
+            }
+        }
+#endif
+        for(; i + 1 < size; i++) {
+            if(data[i] == 0xff && (data[i + 1] & 0xf6) == 0xf0) return i;
+        }
+        return size;
+    }
+
+    struct AdtsStats {
+        std::uint64_t frames = 0;
+        std::uint64_t payload_bytes = 0;
+        std::uint64_t skipped_bytes = 0;    // Bytes dropped while searching for a valid frame
+        std::uint64_t resyncs = 0;          // Number of times the frame chain was lost
+        std::uint64_t rejected_frames = 0;  // Well-formed frames which cannot be stored, e.g. with several raw data blocks
+    };
+
+    // Splits an ADTS stream into raw AAC frames.
+    // A frame is accepted if its header is valid, it belongs to the same stream as the first frame,
+    // and the next frame starts right after it (or it ends exactly at the end of the data).
+    // After a broken frame the next syncword is searched for. The CRC of protected frames is skipped:
+    // it covers parts of the raw data block which can be located only by decoding it.
+    class AdtsParser {
+    public:
+        // Calls f(header, payload, payload_size) for each frame in data, where the payload points into data.
+        // If last is false, a frame which may continue in the next buffer is left unconsumed.
+        // Returns the number of bytes consumed.
+        template<typename F>
+        std::size_t parse(const u8* data, std::size_t size, F&& f, bool last = true) {
+            std::size_t offset = 0;
+            while(offset < size) {
+                if(!this->in_sync) {
+                    const std::size_t found = find_adts_syncword(data + offset, size - offset);
+                    this->stats_.skipped_bytes += found;
+                    offset += found;
+                    if(offset + 1 >= size) {
+                        // Keep a trailing 0xff which may start a syncword in the next buffer.
+                        if(last) {
+                            this->stats_.skipped_bytes += size - offset;
+                            offset = size;
+                        }
+                        break;
+                    }
+                }
+
+                const std::size_t remaining = size - offset;
+                if(remaining < AdtsHeader::SIZE + AdtsHeader::CRC_SIZE && !last) break;
+                if(remaining < AdtsHeader::SIZE) {
+                    // Trailing bytes too short for a header.
+                    this->stats_.skipped_bytes += remaining;
+                    offset = size;
+                    break;
+                }
+                // A frame is valid if its header is valid and the next header follows it.
+                AdtsHeader header;
+                bool valid = parse_adts_header(data + offset, remaining, header)
+                    && (!this->has_first || header.same_stream(this->first));
+                if(valid && header.frame_length > remaining) {
+                    if(!last) break;
+                    valid = false;  // Truncated at the end of the stream
+                }
+                if(valid && header.frame_length < remaining) {
+                    const std::size_t rest = remaining - header.frame_length;
+                    AdtsHeader next;
+                    if(rest < AdtsHeader::SIZE + AdtsHeader::CRC_SIZE && !last) break;
+                    // Fewer bytes than a header after the last frame are dropped by the next iteration.
+                    valid = rest < AdtsHeader::SIZE || parse_adts_header(data + offset + header.frame_length, rest, next);
+                }
+                if(!valid) {
+                    // Skip this syncword and search for the next one.
+                    if(this->in_sync) this->stats_.resyncs++;
+                    this->in_sync = false;
+                    this->stats_.skipped_bytes++;
+                    offset++;
+                    continue;
+                }
+
+                this->in_sync = true;
+                if(!this->has_first) {
+                    this->first = header;
+                    this->has_first = true;
+                }
+                if(header.number_of_raw_data_blocks != 1) {
+                    this->stats_.rejected_frames++;
+                }
+                else {
+                    const std::size_t header_size = header.header_size();
+                    this->stats_.frames++;
+                    this->stats_.payload_bytes += header.frame_length - header_size;
+                    f(static_cast<const AdtsHeader&>(header), data + offset + header_size, std::size_t(header.frame_length - header_size));
+                }
+                offset += header.frame_length;
+            }
+            return offset;
+        }
+
+        // Header of the first accepted frame.
+        bool has_first_header(void) const { return this->has_first; }
+        const AdtsHeader& first_header(void) const { return this->first; }
+        const AdtsStats& stats(void) const { return this->stats_; }
+    private:
+        AdtsHeader first;
+        bool has_first = false;
+        bool in_sync = false;
+        AdtsStats stats_;
+    };
+
+    // Builds the AudioSpecificConfig described by an ADTS header.
+    static void make_audio_specific_config(u8 (&config)[5], const AdtsHeader& header) {
+        make_audio_specific_config(config, header.object_type, header.frequency_index, header.channel_configuration);
+    }
+
+    enum class AdtsRemuxError {
+        None,
+        NoFrames,               // No valid ADTS frame
+        UnsupportedChannels,    // Channel configuration 0 (the layout is given by an in-band PCE)
+    };
+
+    struct AdtsRemuxResult {
+        AdtsRemuxError error = AdtsRemuxError::None;
+        AdtsStats stats;
+    };
+
+    // Remuxes a whole ADTS stream in memory (e.g. a mapped file) into an MP4 file in one pass.
+    // The format and the AudioSpecificConfig are taken from the first valid header, and each payload is
+    // passed to the writer straight from data. Nothing is written if the stream has no valid frame.
+    template<typename S>
+    static AdtsRemuxResult remux_adts(S& stream, const u8* data, std::size_t size, const WriterConfig& config = WriterConfig()) {
+        AdtsRemuxResult result;
+        AdtsParser parser;
+        std::optional<AacMp4Writer<S>> writer;
+        parser.parse(data, size, [&](const AdtsHeader& header, const u8* payload, std::size_t payload_size) {
+            if(!writer) {
+                if(result.error != AdtsRemuxError::None) return;
+                if(header.channel_configuration == 0) {
+                    result.error = AdtsRemuxError::UnsupportedChannels;
+                    return;
+                }
+                writer.emplace(stream, header.sample_rate(), 1024, header.channel_configuration, config);
+                u8 audio_specific_config[5];
+                make_audio_specific_config(audio_specific_config, header);
+                writer->set_audio_specific_config(audio_specific_config);
+            }
+            writer->add_frame(payload, payload_size);
+        }, true);
+        result.stats = parser.stats();
+        if(writer) {
+            writer->finalize();
+        }
+        else if(result.error == AdtsRemuxError::None) {
+            result.error = AdtsRemuxError::NoFrames;
+        }
+        return result;
+    }
+} // namespace AACMP4
@@ -0,0 +1,173 @@
+// SPDX-License-Identifier: BSL-1.0
+// Copyright Kenta Ida 2023.
+// Distributed under the Boost Software License, Version 1.0.
+//    (See accompanying file LICENSE_1_0.txt or copy at
+//          https://www.boost.org/LICENSE_1_0.txt)
+
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <type_traits>
+#include <utility>
+
+#include "primitive_types.hpp"
+#include "stream_adapter.hpp"
+
+namespace AACMP4 {
+    // Decides when DurableSink syncs the written bytes to the storage.
+    // A sync is issued when any enabled condition is met. With everything disabled, the sink never syncs by itself.
+    struct DurabilityPolicy {
+        // Sync when this many bytes have been written since the last sync. 0 disables.
+        std::uint64_t sync_bytes = 0;
+        // Sync when the oldest unsynced byte was written this long ago. 0 disables.
+        // The condition is checked on each write and by poll().
+        std::uint32_t sync_interval_ms = 0;
+        // Sync when the writer marks a fragment boundary: the end of each fragment of FragmentedAacMp4Writer
+        // and each chunk closed by AacMp4Writer.
+        bool sync_on_fragment = false;
+        // Start writing back without waiting every this many bytes, so that a sync has less to wait for.
+        // Used only if the sink provides start_writeback() like FdSink. 0 disables.
+        std::uint64_t writeback_bytes = 0;
+    };
+
+    struct SyncStats {
+        std::uint64_t syncs = 0;
+        std::uint64_t writebacks = 0;       // Calls to start_writeback()
+        std::uint64_t synced_bytes = 0;     // Bytes written before the syncs
+        std::uint64_t total_time_ns = 0;    // Time spent in the syncs
+        std::uint64_t max_time_ns = 0;
+        std::uint64_t last_time_ns = 0;
+    };
+
+    // True if the sink wants to know the fragment boundaries with fragment_boundary().
+    template<typename S, typename = void>
+    struct has_fragment_boundary : std::false_type {};
+    template<typename S>
+    struct has_fragment_boundary<S, decltype(std::declval<S&>().fragment_boundary(), void())> : std::true_type {};
+
+    // Called by the writers after the last byte of a fragment or a chunk has been written.
+    template<typename S>
+    static void mark_fragment_boundary(S& stream) {
+        if constexpr (has_fragment_boundary<S>::value) {
+            stream.fragment_boundary();
+        }
+    }
+
+    // Wraps a sink providing sync() and syncs it according to a DurabilityPolicy.
+    // The frames written between two syncs are committed together, so the cost of a sync is shared by all of them.
+    // The other operations of the sink are passed through.
+    // Call sync() after finalize() of the writer to make the completed file durable.
+    template<typename S>
+    class DurableSink {
+    public:
+        static_assert(has_sync<S>::value, "the sink must provide sync()");
+
+        DurableSink(S& stream, const DurabilityPolicy& policy = DurabilityPolicy()) : stream(stream), policy(policy) {}
+
+        void write(const u8* data, std::size_t size) {
+            this->stream.write(data, size);
+            this->written(size);
+        }
+        std::size_t position(void) {
+            return this->stream.position();
+        }
+        void write_at(std::size_t position, const u8* data, std::size_t size) {
+            this->stream.write_at(position, data, size);
+            this->written(size);
+        }
+        template<typename U = S>
+        auto read_at(std::size_t position, u8* data, std::size_t size) -> decltype(std::declval<U&>().read_at(position, data, size), void()) {
+            this->stream.read_at(position, data, size);
+        }
+        template<typename U = S>
+        auto write_segments(const Segment* segments, std::size_t count) -> decltype(std::declval<U&>().write_segments(segments, count), void()) {
+            this->stream.write_segments(segments, count);
+            std::size_t size = 0;
+            for(std::size_t i = 0; i < count; i++) {
+                size += segments[i].size;
+            }
+            this->written(size);
+        }
+        template<typename U = S>
+        auto acquire(std::size_t max_size) -> decltype(std::declval<U&>().acquire(max_size)) {
+            return this->stream.acquire(max_size);
+        }
+        template<typename U = S>
+        auto commit(std::size_t size) -> decltype(std::declval<U&>().commit(size), void()) {
+            this->stream.commit(size);
+            this->written(size);
+        }
+        template<typename U = S>
+        auto flush(void) -> decltype(std::declval<U&>().flush(), void()) {
+            this->stream.flush();
+        }
+        template<typename U = S>
+        auto error(void) const -> decltype(std::declval<const U&>().error()) {
+            return this->stream.error();
+        }
+
+        void fragment_boundary(void) {
+            if(this->policy.sync_on_fragment) {
+                this->sync();
+            }
+        }
+        // Syncs if the interval has passed. Call it periodically when the writes may pause,
+        // so that the last bytes do not stay unsynced longer than the interval.
+        void poll(void) {
+            if(this->unsynced > 0 && this->policy.sync_interval_ms != 0 && this->interval_elapsed()) {
+                this->sync();
+            }
+        }
+        // Syncs the bytes written so far. Does nothing if nothing has been written since the last sync.
+        void sync(void) {
+            if(this->unsynced == 0) return;
+            const auto start = std::chrono::steady_clock::now();
+            this->stream.sync();
+            const std::uint64_t time_ns = std::uint64_t(std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count());
+            this->stats_.syncs++;
+            this->stats_.synced_bytes += this->unsynced;
+            this->stats_.total_time_ns += time_ns;
+            this->stats_.max_time_ns = time_ns > this->stats_.max_time_ns ? time_ns : this->stats_.max_time_ns;
+            this->stats_.last_time_ns = time_ns;
+            this->unsynced = 0;
+            this->not_written_back = 0;
+        }
+
+        // Number of bytes written since the last sync.
+        std::uint64_t unsynced_bytes(void) const { return this->unsynced; }
+        const SyncStats& stats(void) const { return this->stats_; }
+        const DurabilityPolicy& durability_policy(void) const { return this->policy; }
+    private:
+        void written(std::size_t size) {
+            if(size == 0) return;
+            if(this->unsynced == 0 && this->policy.sync_interval_ms != 0) {
+                this->first_unsynced = std::chrono::steady_clock::now();
+            }
+            this->unsynced += size;
+            this->not_written_back += size;
+            if((this->policy.sync_bytes != 0 && this->unsynced >= this->policy.sync_bytes)
+                || (this->policy.sync_interval_ms != 0 && this->interval_elapsed())) {
+                this->sync();
+                return;
+            }
+            if constexpr (has_start_writeback<S>::value) {
+                if(this->policy.writeback_bytes != 0 && this->not_written_back >= this->policy.writeback_bytes) {
+                    this->stream.start_writeback();
+                    this->stats_.writebacks++;
+                    this->not_written_back = 0;
+                }
+            }
+        }
+        bool interval_elapsed(void) const {
+            return std::chrono::steady_clock::now() - this->first_unsynced >= std::chrono::milliseconds(this->policy.sync_interval_ms);
+        }
+
+        S& stream;
+        DurabilityPolicy policy;
+        std::uint64_t unsynced = 0;
+        std::uint64_t not_written_back = 0;
+        std::chrono::steady_clock::time_point first_unsynced;
+        SyncStats stats_;
+    };
+} // namespace AACMP4
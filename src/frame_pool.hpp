@@ -0,0 +1,123 @@
+// SPDX-License-Identifier: BSL-1.0
+// Copyright Kenta Ida 2023.
+// Distributed under the Boost Software License, Version 1.0.
+//    (See accompanying file LICENSE_1_0.txt or copy at
+//          https://www.boost.org/LICENSE_1_0.txt)
+
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <new>
+
+#include "primitive_types.hpp"
+
+namespace AACMP4 {
+    struct FramePoolStats {
+        std::size_t capacity = 0;           // Number of buffers
+        std::size_t in_use = 0;             // Buffers acquired and not released yet
+        std::size_t high_water_mark = 0;    // Largest in_use seen
+        std::uint64_t acquired = 0;
+        std::uint64_t released = 0;
+        std::uint64_t exhausted = 0;        // acquire() calls which found no free buffer
+    };
+
+    // Fixed number of frame buffers of the same size carved from one slab, e.g. maxOutBufBytes of fdk-aac each.
+    // The encoder takes a buffer with acquire() and encodes into it, and the buffer is returned with release()
+    // once the writer has written the frame, possibly from another thread.
+    // acquire() and release() are lock-free and may be called from any thread; they never allocate.
+    // All memory is allocated by the constructor. The slab starts on a cache line and every buffer is rounded
+    // up to whole cache lines, so buffers released by different threads never share a line.
+    class FramePool {
+    public:
+        static constexpr std::size_t CACHE_LINE = 64;
+
+        FramePool(std::size_t buffer_count, std::size_t buffer_size)
+            : capacity_(buffer_count)
+            , stride((buffer_size + CACHE_LINE - 1) / CACHE_LINE * CACHE_LINE)
+            , buffer_size_(buffer_size)
+            , slab(static_cast<u8*>(::operator new[](buffer_count * this->stride, std::align_val_t(CACHE_LINE))))
+            , next(new std::atomic<std::uint32_t>[buffer_count])
+        {
+            // Every buffer starts on the free list, in order.
+            for(std::size_t i = 0; i < buffer_count; i++) {
+                this->next[i].store(i + 1 < buffer_count ? std::uint32_t(i + 1) : EMPTY, std::memory_order_relaxed);
+            }
+            this->head.store(pack(0, buffer_count > 0 ? 0 : EMPTY), std::memory_order_relaxed);
+        }
+        FramePool(const FramePool&) = delete;
+        FramePool& operator=(const FramePool&) = delete;
+
+        std::size_t capacity(void) const { return this->capacity_; }
+        std::size_t buffer_size(void) const { return this->buffer_size_; }
+
+        // Returns a free buffer of buffer_size() bytes, or nullptr if every buffer is in use.
+        u8* acquire(void) {
+            std::uint64_t head = this->head.load(std::memory_order_acquire);
+            for(;;) {
+                const std::uint32_t index = std::uint32_t(head);
+                if(index == EMPTY) {
+                    this->exhausted.fetch_add(1, std::memory_order_relaxed);
+                    return nullptr;
+                }
+                // The tag changes on every update, so a head popped and pushed back in between fails the exchange.
+                const std::uint64_t new_head = pack(std::uint32_t(head >> 32) + 1, this->next[index].load(std::memory_order_relaxed));
+                if(this->head.compare_exchange_weak(head, new_head, std::memory_order_acquire, std::memory_order_acquire)) {
+                    this->acquired.fetch_add(1, std::memory_order_relaxed);
+                    const std::size_t in_use = this->in_use.fetch_add(1, std::memory_order_relaxed) + 1;
+                    std::size_t current = this->high_water_mark.load(std::memory_order_relaxed);
+                    while(in_use > current && !this->high_water_mark.compare_exchange_weak(current, in_use, std::memory_order_relaxed)) {}
+                    return this->slab.get() + std::size_t(index) * this->stride;
+                }
+            }
+        }
+        // Returns a buffer obtained from acquire() to the pool.
+        void release(const u8* buffer) {
+            const std::uint32_t index = std::uint32_t(std::size_t(buffer - this->slab.get()) / this->stride);
+            std::uint64_t head = this->head.load(std::memory_order_relaxed);
+            for(;;) {
+                this->next[index].store(std::uint32_t(head), std::memory_order_relaxed);
+                if(this->head.compare_exchange_weak(head, pack(std::uint32_t(head >> 32) + 1, index), std::memory_order_release, std::memory_order_relaxed)) break;
+            }
+            this->released.fetch_add(1, std::memory_order_relaxed);
+            this->in_use.fetch_sub(1, std::memory_order_relaxed);
+        }
+        // True if the buffer belongs to this pool.
+        bool owns(const u8* buffer) const {
+            return buffer >= this->slab.get() && buffer < this->slab.get() + this->capacity_ * this->stride;
+        }
+
+        // May be called from any thread. The values are read one by one, so they may be slightly inconsistent.
+        FramePoolStats stats(void) const {
+            FramePoolStats stats;
+            stats.capacity = this->capacity_;
+            stats.in_use = this->in_use.load(std::memory_order_relaxed);
+            stats.high_water_mark = this->high_water_mark.load(std::memory_order_relaxed);
+            stats.acquired = this->acquired.load(std::memory_order_relaxed);
+            stats.released = this->released.load(std::memory_order_relaxed);
+            stats.exhausted = this->exhausted.load(std::memory_order_relaxed);
+            return stats;
+        }
+    private:
+        static constexpr std::uint32_t EMPTY = 0xffffffffu;
+        // The head of the free list is the index of the first free buffer in the low half and an update count in the high half.
+        static std::uint64_t pack(std::uint32_t tag, std::uint32_t index) { return (std::uint64_t(tag) << 32) | index; }
+        struct AlignedDelete {
+            void operator()(u8* slab) const { ::operator delete[](slab, std::align_val_t(CACHE_LINE)); }
+        };
+
+        const std::size_t capacity_;
+        const std::size_t stride;
+        const std::size_t buffer_size_;
+        std::unique_ptr<u8[], AlignedDelete> slab;
+        std::unique_ptr<std::atomic<std::uint32_t>[]> next;     // Next free buffer of each free buffer
+
+        alignas(CACHE_LINE) std::atomic<std::uint64_t> head{0};
+        alignas(CACHE_LINE) std::atomic<std::size_t> in_use{0};
+        std::atomic<std::size_t> high_water_mark{0};
+        std::atomic<std::uint64_t> acquired{0};
+        std::atomic<std::uint64_t> released{0};
+        std::atomic<std::uint64_t> exhausted{0};
+    };
+} // namespace AACMP4
@@ -0,0 +1,238 @@
+// SPDX-License-Identifier: BSL-1.0
+// Copyright Kenta Ida 2023.
+// Distributed under the Boost Software License, Version 1.0.
+//    (See accompanying file LICENSE_1_0.txt or copy at
+//          https://www.boost.org/LICENSE_1_0.txt)
+
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <limits>
+#include <thread>
+#include <vector>
+
+#include "primitive_types.hpp"
+
+namespace AACMP4 {
+    struct FrameQueueStats {
+        std::size_t capacity = 0;           // Number of slots
+        std::size_t depth = 0;              // Frames in the queue
+        std::size_t high_water_mark = 0;    // Largest depth seen by the consumer, or the capacity after a drop
+        std::uint64_t pushed = 0;
+        std::uint64_t popped = 0;
+        std::uint64_t dropped = 0;          // Frames given up because the queue was full or the frame too large
+    };
+
+    // Lock-free ring of preallocated frame slots between one producer thread and one consumer thread.
+    // The producer never allocates nor blocks: a frame which does not fit is dropped and counted.
+    // A producer which would rather wait for a slot retries try_acquire() or try_push(), which count nothing.
+    // All memory is allocated by the constructor.
+    class FrameQueue {
+    public:
+        static constexpr std::size_t CACHE_LINE = 64;
+
+        // slot_count is rounded up to a power of two. max_frame_size is the largest frame accepted,
+        // e.g. maxOutBufBytes of fdk-aac.
+        FrameQueue(std::size_t slot_count, std::size_t max_frame_size)
+            : mask(round_up_to_power_of_two(slot_count) - 1)
+            , stride((max_frame_size + CACHE_LINE - 1) / CACHE_LINE * CACHE_LINE)
+            , max_frame_size(max_frame_size)
+            , slots((this->mask + 1) * this->stride)
+            , sizes(this->mask + 1)
+        {}
+        FrameQueue(const FrameQueue&) = delete;
+        FrameQueue& operator=(const FrameQueue&) = delete;
+
+        std::size_t capacity(void) const { return this->mask + 1; }
+        std::size_t frame_capacity(void) const { return this->max_frame_size; }
+
+        // Producer: returns the slot to encode the next frame into, or nullptr if the queue is full.
+        // A nullptr is counted as a dropped frame.
+        u8* acquire(void) {
+            u8* slot = this->try_acquire();
+            if(slot == nullptr) {
+                this->drop();
+                this->update_high_water_mark(this->capacity());
+            }
+            return slot;
+        }
+        // Producer: same as acquire(), but a full queue is not counted, so that the call can be retried.
+        u8* try_acquire(void) {
+            const std::uint64_t head = this->head.load(std::memory_order_relaxed);
+            if(head - this->cached_tail > this->mask) {
+                this->cached_tail = this->tail.load(std::memory_order_acquire);
+                if(head - this->cached_tail > this->mask) return nullptr;
+            }
+            return this->slots.data() + (head & this->mask) * this->stride;
+        }
+        // Producer: publishes the frame of size bytes written into the slot returned by acquire().
+        void commit(std::size_t size) {
+            const std::uint64_t head = this->head.load(std::memory_order_relaxed);
+            this->sizes[head & this->mask] = std::uint32_t(size);
+            this->head.store(head + 1, std::memory_order_release);
+        }
+        // Producer: copies a frame into the queue. Returns false if it was dropped.
+        bool push(const u8* data, std::size_t size) {
+            if(size > this->max_frame_size) {
+                this->drop();
+                return false;
+            }
+            u8* slot = this->acquire();
+            if(slot == nullptr) return false;
+            std::memcpy(slot, data, size);
+            this->commit(size);
+            return true;
+        }
+        // Producer: same as push(), but returns false without counting a drop if the queue is full.
+        // A frame larger than frame_capacity() never fits, so it is dropped and counted.
+        bool try_push(const u8* data, std::size_t size) {
+            if(size > this->max_frame_size) {
+                this->drop();
+                return false;
+            }
+            u8* slot = this->try_acquire();
+            if(slot == nullptr) return false;
+            std::memcpy(slot, data, size);
+            this->commit(size);
+            return true;
+        }
+
+        // Consumer: calls f(data, size) for up to max_count queued frames in order, then releases their slots at once.
+        // Returns the number of frames consumed.
+        template<typename F>
+        std::size_t consume(F&& f, std::size_t max_count = std::numeric_limits<std::size_t>::max()) {
+            const std::uint64_t tail = this->tail.load(std::memory_order_relaxed);
+            if(this->cached_head == tail) {
+                this->cached_head = this->head.load(std::memory_order_acquire);
+                if(this->cached_head == tail) return 0;
+            }
+            const std::size_t depth = std::size_t(this->cached_head - tail);
+            this->update_high_water_mark(depth);
+            const std::size_t count = depth < max_count ? depth : max_count;
+            for(std::size_t i = 0; i < count; i++) {
+                const std::size_t index = std::size_t((tail + i) & this->mask);
+                f(static_cast<const u8*>(this->slots.data() + index * this->stride), std::size_t(this->sizes[index]));
+            }
+            this->tail.store(tail + count, std::memory_order_release);
+            return count;
+        }
+
+        // May be called from any thread. The values are read one by one, so they may be slightly inconsistent.
+        FrameQueueStats stats(void) const {
+            FrameQueueStats stats;
+            stats.popped = this->tail.load(std::memory_order_acquire);
+            stats.pushed = this->head.load(std::memory_order_acquire);
+            stats.capacity = this->capacity();
+            stats.depth = std::size_t(stats.pushed - stats.popped);
+            stats.high_water_mark = this->high_water_mark.load(std::memory_order_relaxed);
+            stats.dropped = this->dropped.load(std::memory_order_relaxed);
+            return stats;
+        }
+        std::size_t depth(void) const {
+            return std::size_t(this->head.load(std::memory_order_acquire) - this->tail.load(std::memory_order_acquire));
+        }
+    private:
+        // Only the producer counts drops.
+        void drop(void) {
+            this->dropped.store(this->dropped.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+        }
+        // Updated by both threads, only when the consumer takes frames or the producer drops one.
+        void update_high_water_mark(std::size_t depth) {
+            std::size_t current = this->high_water_mark.load(std::memory_order_relaxed);
+            while(depth > current && !this->high_water_mark.compare_exchange_weak(current, depth, std::memory_order_relaxed)) {}
+        }
+
+        static std::size_t round_up_to_power_of_two(std::size_t value) {
+            std::size_t result = 1;
+            while(result < value) result <<= 1;
+            return result;
+        }
+
+        const std::size_t mask;
+        const std::size_t stride;
+        const std::size_t max_frame_size;
+        std::vector<u8> slots;
+        std::vector<std::uint32_t> sizes;
+
+        // The counters of each side are kept on their own cache line.
+        alignas(CACHE_LINE) std::atomic<std::uint64_t> head{0};     // Written by the producer
+        std::uint64_t cached_tail = 0;
+        std::atomic<std::uint64_t> dropped{0};
+        alignas(CACHE_LINE) std::atomic<std::uint64_t> tail{0};     // Written by the consumer
+        std::uint64_t cached_head = 0;
+        std::atomic<std::size_t> high_water_mark{0};
+    };
+
+    struct AsyncWriterConfig {
+        std::size_t slot_count = 256;
+        std::size_t max_frame_size = 768 * 8;   // 6144 bits per channel, 8 channels
+        // Frames passed to the writer before their slots are released.
+        std::size_t batch_frames = 32;
+        // Sleep of the writer thread when the queue is empty.
+        std::uint32_t idle_wait_us = 1000;
+    };
+
+    // Moves the writes of a writer to a dedicated thread.
+    // The encoder thread pushes frames into a FrameQueue, and the writer thread passes them to
+    // writer.add_frame(data, size) in batches, so that a stall of the storage does not stall the encoder.
+    // The writer must not be used by other threads until stop() returns; call finalize() of the writer after it.
+    template<typename W>
+    class AsyncFrameWriter {
+    public:
+        AsyncFrameWriter(W& writer, const AsyncWriterConfig& config = AsyncWriterConfig())
+            : writer(writer), config(config), queue_(config.slot_count, config.max_frame_size)
+        {
+            this->thread = std::thread([this]() { this->run(); });
+        }
+        ~AsyncFrameWriter() { this->stop(); }
+        AsyncFrameWriter(const AsyncFrameWriter&) = delete;
+        AsyncFrameWriter& operator=(const AsyncFrameWriter&) = delete;
+
+        // Encoder thread: see FrameQueue.
+        bool push(const u8* data, std::size_t size) { return this->queue_.push(data, size); }
+        bool try_push(const u8* data, std::size_t size) { return this->queue_.try_push(data, size); }
+        u8* acquire(void) { return this->queue_.acquire(); }
+        u8* try_acquire(void) { return this->queue_.try_acquire(); }
+        void commit(std::size_t size) { this->queue_.commit(size); }
+
+        // Writes the queued frames and stops the writer thread.
+        void stop(void) {
+            if(!this->thread.joinable()) return;
+            this->running.store(false, std::memory_order_release);
+            this->thread.join();
+        }
+
+        FrameQueueStats stats(void) const { return this->queue_.stats(); }
+        // Number of batches passed to the writer.
+        std::uint64_t batches(void) const { return this->batches_.load(std::memory_order_relaxed); }
+        const FrameQueue& queue(void) const { return this->queue_; }
+    private:
+        std::size_t drain(void) {
+            const std::size_t count = this->queue_.consume([this](const u8* data, std::size_t size) {
+                this->writer.add_frame(data, size);
+            }, this->config.batch_frames > 0 ? this->config.batch_frames : 1);
+            if(count > 0) {
+                this->batches_.store(this->batches_.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+            }
+            return count;
+        }
+        void run(void) {
+            while(this->running.load(std::memory_order_acquire)) {
+                if(this->drain() == 0) {
+                    std::this_thread::sleep_for(std::chrono::microseconds(this->config.idle_wait_us));
+                }
+            }
+            while(this->drain() > 0) {}
+        }
+
+        W& writer;
+        AsyncWriterConfig config;
+        FrameQueue queue_;
+        std::atomic<bool> running{true};
+        std::atomic<std::uint64_t> batches_{0};
+        std::thread thread;
+    };
+} // namespace AACMP4
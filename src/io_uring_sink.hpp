@@ -0,0 +1,439 @@
+// SPDX-License-Identifier: BSL-1.0
+// Copyright Kenta Ida 2023.
+// Distributed under the Boost Software License, Version 1.0.
+//    (See accompanying file LICENSE_1_0.txt or copy at
+//          https://www.boost.org/LICENSE_1_0.txt)
+
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+#include "primitive_types.hpp"
+
+#if __has_include(<unistd.h>) && __has_include(<sys/uio.h>)
+#include <cerrno>
+#include <sys/uio.h>
+#include <unistd.h>
+#define AACMP4_HAS_IO_URING_SINK
+#if defined(__linux__) && __has_include(<linux/io_uring.h>) && __has_include(<sys/syscall.h>)
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#if defined(__NR_io_uring_setup) && defined(__NR_io_uring_enter)
+#define AACMP4_HAS_IO_URING
+#endif
+#endif
+#endif
+
+#ifdef AACMP4_HAS_IO_URING_SINK
+namespace AACMP4 {
+    // A write queued to an IoUring. complete() is called with the result of the write when it is reaped.
+    struct IoUringRequest {
+        void (*complete)(IoUringRequest* request, std::int32_t result) = nullptr;
+        struct iovec iov = {nullptr, 0};
+    };
+
+    struct IoUringStats {
+        std::uint64_t writes = 0;       // Writes queued
+        std::uint64_t completions = 0;  // Writes reaped
+        std::uint64_t enters = 0;       // io_uring_enter() calls
+    };
+
+    // Submission and completion rings of io_uring, set up with the raw system calls.
+    // Several IoUringSink may share one ring, so that one thread drives the writes of many files and
+    // reaps their completions in batches. The ring and its sinks must be used from one thread.
+    // If io_uring is not available (old kernel, seccomp, non-Linux), available() is false and the sinks
+    // write synchronously with pwrite().
+    class IoUring {
+    public:
+        explicit IoUring(unsigned entries = 256) {
+#ifdef AACMP4_HAS_IO_URING
+            this->setup(entries);
+#else
+            (void)entries;
+#endif
+        }
+        ~IoUring() {
+            while(this->in_flight_ > 0 && this->reap(1) > 0) {}
+            this->close();
+        }
+        IoUring(const IoUring&) = delete;
+        IoUring& operator=(const IoUring&) = delete;
+
+        bool available(void) const { return this->fd >= 0; }
+        // Writes queued or submitted and not reaped yet.
+        std::size_t in_flight(void) const { return this->in_flight_; }
+        const IoUringStats& stats(void) const { return this->stats_; }
+
+        // Queues a vectored write of request->iov. With ordered set, the write starts after every write queued
+        // before it has completed, and the writes queued after it start after it has completed.
+        // Must be called only if available().
+        void queue_write(int file, std::uint64_t offset, IoUringRequest* request, bool ordered) {
+#ifdef AACMP4_HAS_IO_URING
+            // Keep the number of writes in flight within the completion ring so that no completion is lost.
+            while(this->in_flight_ >= this->cq_entries && this->reap(1) > 0) {}
+            const unsigned tail = *this->sq_tail;
+            if(tail - __atomic_load_n(this->sq_head, __ATOMIC_ACQUIRE) == this->sq_entries) {
+                // Without SQPOLL the kernel takes the entries while they are submitted.
+                this->submit();
+                if(tail - __atomic_load_n(this->sq_head, __ATOMIC_ACQUIRE) == this->sq_entries) {
+                    request->complete(request, -EBUSY);
+                    return;
+                }
+            }
+            const unsigned index = tail & *this->sq_mask;
+            struct io_uring_sqe& sqe = this->sqes[index];
+            std::memset(&sqe, 0, sizeof(sqe));
+            sqe.opcode = IORING_OP_WRITEV;
+            sqe.fd = file;
+            sqe.flags = ordered ? IOSQE_IO_DRAIN : 0;
+            sqe.off = offset;
+            sqe.addr = reinterpret_cast<std::uint64_t>(&request->iov);
+            sqe.len = 1;
+            sqe.user_data = reinterpret_cast<std::uint64_t>(request);
+            this->sq_array[index] = index;
+            __atomic_store_n(this->sq_tail, tail + 1, __ATOMIC_RELEASE);
+            this->queued++;
+            this->in_flight_++;
+            this->stats_.writes++;
+#else
+            (void)file;
+            (void)offset;
+            (void)request;
+            (void)ordered;
+#endif
+        }
+
+        // Passes the queued writes to the kernel without waiting for them.
+        void submit(void) {
+            if(this->queued > 0) {
+                this->enter(0, 0);
+            }
+        }
+
+        // Calls complete() of every completed write, waiting until at least min_complete writes have completed
+        // or nothing is in flight. Queued writes are submitted first. Returns the number of writes reaped.
+        std::size_t reap(std::size_t min_complete = 0) {
+            std::size_t reaped = 0;
+#ifdef AACMP4_HAS_IO_URING
+            if(!this->available()) return 0;
+            for(;;) {
+                unsigned head = *this->cq_head;
+                const unsigned tail = __atomic_load_n(this->cq_tail, __ATOMIC_ACQUIRE);
+                while(head != tail) {
+                    const struct io_uring_cqe& cqe = this->cqes[head & *this->cq_mask];
+                    IoUringRequest* request = reinterpret_cast<IoUringRequest*>(cqe.user_data);
+                    const std::int32_t result = cqe.res;
+                    head++;
+                    __atomic_store_n(this->cq_head, head, __ATOMIC_RELEASE);
+                    this->in_flight_--;
+                    this->stats_.completions++;
+                    reaped++;
+                    // The request may queue another write for the rest of the data.
+                    request->complete(request, result);
+                }
+                if(reaped >= min_complete || this->in_flight_ == 0) break;
+                if(!this->enter(unsigned(min_complete - reaped), 0)) break;
+            }
+#else
+            (void)min_complete;
+#endif
+            return reaped;
+        }
+    private:
+#ifdef AACMP4_HAS_IO_URING
+        void setup(unsigned entries) {
+            struct io_uring_params params;
+            std::memset(&params, 0, sizeof(params));
+            const int ring = int(::syscall(__NR_io_uring_setup, entries, &params));
+            if(ring < 0) return;
+
+            this->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+            this->cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+            const bool single_mmap = (params.features & IORING_FEAT_SINGLE_MMAP) != 0;
+            if(single_mmap) {
+                this->sq_ring_size = this->sq_ring_size > this->cq_ring_size ? this->sq_ring_size : this->cq_ring_size;
+                this->cq_ring_size = this->sq_ring_size;
+            }
+            void* sq = ::mmap(nullptr, this->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring, IORING_OFF_SQ_RING);
+            void* cq = single_mmap ? sq : ::mmap(nullptr, this->cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring, IORING_OFF_CQ_RING);
+            void* sqes = ::mmap(nullptr, params.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring, IORING_OFF_SQES);
+            if(sq == MAP_FAILED || cq == MAP_FAILED || sqes == MAP_FAILED) {
+                if(sq != MAP_FAILED) ::munmap(sq, this->sq_ring_size);
+                if(!single_mmap && cq != MAP_FAILED) ::munmap(cq, this->cq_ring_size);
+                if(sqes != MAP_FAILED) ::munmap(sqes, params.sq_entries * sizeof(struct io_uring_sqe));
+                ::close(ring);
+                return;
+            }
+            this->sq_ring = static_cast<u8*>(sq);
+            this->cq_ring = static_cast<u8*>(cq);
+            this->sqes = static_cast<struct io_uring_sqe*>(sqes);
+            this->sq_head = reinterpret_cast<unsigned*>(this->sq_ring + params.sq_off.head);
+            this->sq_tail = reinterpret_cast<unsigned*>(this->sq_ring + params.sq_off.tail);
+            this->sq_mask = reinterpret_cast<unsigned*>(this->sq_ring + params.sq_off.ring_mask);
+            this->sq_array = reinterpret_cast<unsigned*>(this->sq_ring + params.sq_off.array);
+            this->cq_head = reinterpret_cast<unsigned*>(this->cq_ring + params.cq_off.head);
+            this->cq_tail = reinterpret_cast<unsigned*>(this->cq_ring + params.cq_off.tail);
+            this->cq_mask = reinterpret_cast<unsigned*>(this->cq_ring + params.cq_off.ring_mask);
+            this->cqes = reinterpret_cast<struct io_uring_cqe*>(this->cq_ring + params.cq_off.cqes);
+            this->sq_entries = params.sq_entries;
+            this->cq_entries = params.cq_entries;
+            this->fd = ring;
+        }
+
+        // Submits the queued writes and waits for min_complete completions. Returns false on an error.
+        bool enter(unsigned min_complete, unsigned flags) {
+            if(min_complete > 0) {
+                flags |= IORING_ENTER_GETEVENTS;
+            }
+            for(;;) {
+                const long result = ::syscall(__NR_io_uring_enter, this->fd, this->queued, min_complete, flags, nullptr, 0);
+                this->stats_.enters++;
+                if(result >= 0) {
+                    this->queued -= unsigned(result) < this->queued ? unsigned(result) : this->queued;
+                    return true;
+                }
+                if(errno != EINTR && errno != EAGAIN && errno != EBUSY) return false;
+            }
+        }
+#endif
+
+        void close(void) {
+#ifdef AACMP4_HAS_IO_URING
+            if(this->fd < 0) return;
+            ::munmap(this->sqes, this->sq_entries * sizeof(struct io_uring_sqe));
+            if(this->cq_ring != this->sq_ring) {
+                ::munmap(this->cq_ring, this->cq_ring_size);
+            }
+            ::munmap(this->sq_ring, this->sq_ring_size);
+            ::close(this->fd);
+            this->fd = -1;
+#endif
+        }
+
+        int fd = -1;
+        std::size_t in_flight_ = 0;
+        IoUringStats stats_;
+#ifdef AACMP4_HAS_IO_URING
+        unsigned queued = 0;    // Writes in the submission ring not passed to the kernel yet
+        u8* sq_ring = nullptr;
+        u8* cq_ring = nullptr;
+        std::size_t sq_ring_size = 0;
+        std::size_t cq_ring_size = 0;
+        struct io_uring_sqe* sqes = nullptr;
+        struct io_uring_cqe* cqes = nullptr;
+        unsigned* sq_head = nullptr;
+        unsigned* sq_tail = nullptr;
+        unsigned* sq_mask = nullptr;
+        unsigned* sq_array = nullptr;
+        unsigned* cq_head = nullptr;
+        unsigned* cq_tail = nullptr;
+        unsigned* cq_mask = nullptr;
+        unsigned sq_entries = 0;
+        unsigned cq_entries = 0;
+#endif
+    };
+
+    // Writes to a file descriptor through an IoUring without waiting for the writes.
+    // The written bytes are copied into a small set of buffers; a full buffer is queued as one write and
+    // reused when its completion is reaped. write_at() is queued as an ordered write so that it lands after
+    // the earlier writes of the same range, and read_at() waits for the writes of this sink.
+    // The position is tracked by the sink, so the descriptor must not be written by others.
+    // The first error is kept in error() and the following writes are ignored.
+    class IoUringSink {
+    public:
+        IoUringSink(IoUring& ring, int fd, std::size_t buffer_size = 64 * 1024, std::size_t buffer_count = 4)
+            : ring(ring), fd(fd), buffer_size(buffer_size > 0 ? buffer_size : 1), buffers(buffer_count > 0 ? buffer_count : 1)
+        {
+            for(auto& buffer : this->buffers) {
+                buffer.complete = &IoUringSink::on_complete;
+                buffer.owner = this;
+                buffer.data.resize(this->buffer_size);
+            }
+            off_t current = ::lseek(fd, 0, SEEK_CUR);
+            this->position_ = current < 0 ? 0 : std::uint64_t(current);
+        }
+        ~IoUringSink() { this->wait(); }
+        IoUringSink(const IoUringSink&) = delete;
+        IoUringSink& operator=(const IoUringSink&) = delete;
+
+        void write(const u8* data, std::size_t size) {
+            while(size > 0 && this->error_ == 0) {
+                if(this->current == nullptr) {
+                    this->current = this->take_buffer();
+                    this->current->offset = this->position_;
+                }
+                const std::size_t room = this->buffer_size - this->current->size;
+                const std::size_t bytes_to_copy = size < room ? size : room;
+                std::memcpy(this->current->data.data() + this->current->size, data, bytes_to_copy);
+                this->current->size += bytes_to_copy;
+                this->position_ += bytes_to_copy;
+                data += bytes_to_copy;
+                size -= bytes_to_copy;
+                if(this->current->size == this->buffer_size) {
+                    this->queue_current();
+                }
+            }
+        }
+        std::size_t position(void) const { return this->position_; }
+        void write_at(std::size_t position, const u8* data, std::size_t size) {
+            this->queue_current();
+            while(size > 0 && this->error_ == 0) {
+                Buffer* buffer = this->take_buffer();
+                const std::size_t bytes_to_copy = size < this->buffer_size ? size : this->buffer_size;
+                std::memcpy(buffer->data.data(), data, bytes_to_copy);
+                buffer->size = bytes_to_copy;
+                buffer->offset = position;
+                this->queue(buffer, true);
+                position += bytes_to_copy;
+                data += bytes_to_copy;
+                size -= bytes_to_copy;
+            }
+        }
+        void read_at(std::size_t position, u8* data, std::size_t size) {
+            this->wait();
+            while(size > 0 && this->error_ == 0) {
+                ssize_t bytes_read = ::pread(this->fd, data, size, off_t(position));
+                if(bytes_read <= 0) {
+                    if(bytes_read == 0) this->error_ = EIO;
+                    else if(errno != EINTR) this->error_ = errno;
+                    continue;
+                }
+                data += bytes_read;
+                position += bytes_read;
+                size -= bytes_read;
+            }
+        }
+        // Queues the buffered bytes and submits the queued writes without waiting for them.
+        void flush(void) {
+            this->queue_current();
+            this->ring.submit();
+        }
+        // Flushes and waits until every write of this sink has completed.
+        void wait(void) {
+            this->flush();
+            while(this->pending > 0 && this->ring.reap(1) > 0) {}
+        }
+        // Waits for the writes and for the written data to reach the storage.
+        void sync(void) {
+            this->wait();
+            if(this->error_ != 0) return;
+#if defined(__APPLE__)
+            while(::fsync(this->fd) != 0) {
+#else
+            while(::fdatasync(this->fd) != 0) {
+#endif
+                if(errno != EINTR) {
+                    this->error_ = errno;
+                    break;
+                }
+            }
+        }
+        // Number of writes of this sink in flight.
+        std::size_t pending_writes(void) const { return this->pending; }
+        int error(void) const { return this->error_; }
+    private:
+        struct Buffer : IoUringRequest {
+            IoUringSink* owner = nullptr;
+            std::vector<u8> data;
+            std::size_t size = 0;
+            std::size_t written = 0;
+            std::uint64_t offset = 0;
+            bool busy = false;
+        };
+
+        // Returns an idle buffer, reaping completions until one becomes idle.
+        // If the ring fails, the error is set and a buffer whose contents are discarded is returned.
+        Buffer* take_buffer(void) {
+            for(;;) {
+                for(auto& buffer : this->buffers) {
+                    if(!buffer.busy) {
+                        buffer.busy = true;
+                        buffer.size = 0;
+                        return &buffer;
+                    }
+                }
+                if(this->ring.reap(1) == 0) {
+                    this->error_ = this->error_ != 0 ? this->error_ : EIO;
+                    this->discarded.data.resize(this->buffer_size);
+                    this->discarded.size = 0;
+                    return &this->discarded;
+                }
+            }
+        }
+
+        void queue_current(void) {
+            if(this->current == nullptr) return;
+            if(this->current->size == 0) {
+                this->current->busy = false;
+            }
+            else {
+                this->queue(this->current, false);
+            }
+            this->current = nullptr;
+        }
+
+        void queue(Buffer* buffer, bool ordered) {
+            buffer->written = 0;
+            if(this->error_ != 0) {
+                buffer->busy = false;
+                return;
+            }
+            if(!this->ring.available()) {
+                // Synchronous fallback.
+                while(buffer->written < buffer->size && this->error_ == 0) {
+                    ssize_t written = ::pwrite(this->fd, buffer->data.data() + buffer->written, buffer->size - buffer->written, off_t(buffer->offset + buffer->written));
+                    if(written < 0) {
+                        if(errno != EINTR) this->error_ = errno;
+                        continue;
+                    }
+                    buffer->written += std::size_t(written);
+                }
+                buffer->busy = false;
+                return;
+            }
+            this->pending++;
+            this->queue_rest(buffer, ordered);
+        }
+        void queue_rest(Buffer* buffer, bool ordered) {
+            buffer->iov.iov_base = buffer->data.data() + buffer->written;
+            buffer->iov.iov_len = buffer->size - buffer->written;
+            this->ring.queue_write(this->fd, buffer->offset + buffer->written, buffer, ordered);
+        }
+
+        static void on_complete(IoUringRequest* request, std::int32_t result) {
+            Buffer* buffer = static_cast<Buffer*>(request);
+            IoUringSink* self = buffer->owner;
+            if(result == -EINTR || result == -EAGAIN) {
+                self->queue_rest(buffer, false);
+                return;
+            }
+            if(result > 0 && self->error_ == 0) {
+                buffer->written += std::size_t(result);
+                if(buffer->written < buffer->size) {
+                    // Short write: queue the rest.
+                    self->queue_rest(buffer, false);
+                    return;
+                }
+            }
+            else if(self->error_ == 0) {
+                self->error_ = result < 0 ? -result : EIO;
+            }
+            buffer->busy = false;
+            self->pending--;
+        }
+
+        IoUring& ring;
+        int fd;
+        std::size_t buffer_size;
+        std::vector<Buffer> buffers;
+        Buffer discarded;
+        Buffer* current = nullptr;
+        std::uint64_t position_ = 0;
+        std::size_t pending = 0;
+        int error_ = 0;
+    };
+} // namespace AACMP4
+#endif // AACMP4_HAS_IO_URING_SINK
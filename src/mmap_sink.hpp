@@ -0,0 +1,137 @@
+// SPDX-License-Identifier: BSL-1.0
+// Copyright Kenta Ida 2023.
+// Distributed under the Boost Software License, Version 1.0.
+//    (See accompanying file LICENSE_1_0.txt or copy at
+//          https://www.boost.org/LICENSE_1_0.txt)
+
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+
+#include "primitive_types.hpp"
+
+#if __has_include(<sys/mman.h>) && __has_include(<unistd.h>) && __has_include(<fcntl.h>)
+#include <cerrno>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+namespace AACMP4 {
+    // Writes to a preallocated file through a shared memory mapping.
+    // The file is extended to the expected size up front and grown by doubling when needed.
+    // close() truncates the file to the written size.
+    // acquire()/commit() let an encoder write a frame directly into the mapping.
+    // The first error is kept in error() and the following writes are ignored.
+    class MmapSink {
+    public:
+        MmapSink(const char* path, std::size_t expected_size) {
+            this->fd = ::open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+            if(this->fd < 0) {
+                this->error_ = errno;
+                return;
+            }
+            this->map(expected_size > 0 ? expected_size : 4096);
+        }
+        ~MmapSink() { this->close(); }
+
+        MmapSink(const MmapSink&) = delete;
+        MmapSink& operator=(const MmapSink&) = delete;
+
+        void write(const u8* data, std::size_t size) {
+            if(!this->reserve(size)) return;
+            std::memcpy(this->base + this->position_, data, size);
+            this->commit(size);
+        }
+        std::size_t position(void) const { return this->position_; }
+        // Overwrites or extends the file at the given position without moving the write position.
+        void write_at(std::size_t position, const u8* data, std::size_t size) {
+            if(this->error_ != 0) return;
+            if(position + size > this->position_ && !this->reserve(position + size - this->position_)) return;
+            if(position + size > this->capacity) return;
+            std::memcpy(this->base + position, data, size);
+            this->size_ = position + size > this->size_ ? position + size : this->size_;
+        }
+        void read_at(std::size_t position, u8* data, std::size_t size) {
+            if(this->error_ != 0 || position + size > this->capacity) return;
+            std::memcpy(data, this->base + position, size);
+        }
+
+        // Returns the place to write the next max_size bytes at most, or nullptr on error.
+        u8* acquire(std::size_t max_size) {
+            return this->reserve(max_size) ? this->base + this->position_ : nullptr;
+        }
+        // Marks size bytes from the place returned by acquire() as written.
+        void commit(std::size_t size) {
+            this->position_ += size;
+            this->size_ = this->position_ > this->size_ ? this->position_ : this->size_;
+        }
+
+        // Waits until the written part of the mapping reaches the storage.
+        void sync(void) {
+            if(this->error_ != 0 || this->base == nullptr || this->size_ == 0) return;
+            if(::msync(this->base, this->size_, MS_SYNC) != 0) {
+                this->error_ = errno;
+            }
+        }
+
+        // Unmaps the file and truncates it to the written size.
+        void close(void) {
+            if(this->fd < 0) return;
+            this->unmap();
+            if(::ftruncate(this->fd, off_t(this->size_)) != 0 && this->error_ == 0) {
+                this->error_ = errno;
+            }
+            ::close(this->fd);
+            this->fd = -1;
+        }
+        int error(void) const { return this->error_; }
+    private:
+        bool reserve(std::size_t size) {
+            if(this->error_ != 0) return false;
+            if(this->position_ + size <= this->capacity) return true;
+            // Grow the file to at least twice of its size.
+            std::size_t new_capacity = this->capacity * 2;
+            if(new_capacity < this->position_ + size) {
+                new_capacity = this->position_ + size;
+            }
+            this->unmap();
+            return this->map(new_capacity);
+        }
+
+        bool map(std::size_t size) {
+            int result = EOPNOTSUPP;
+#if defined(__linux__)
+            result = ::fallocate(this->fd, 0, 0, off_t(size)) == 0 ? 0 : errno;
+#endif
+            // Fall back to a sparse file if the file system cannot preallocate.
+            if(result != 0 && ::ftruncate(this->fd, off_t(size)) != 0) {
+                this->error_ = errno;
+                return false;
+            }
+            void* mapping = ::mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, this->fd, 0);
+            if(mapping == MAP_FAILED) {
+                this->error_ = errno;
+                return false;
+            }
+            this->base = static_cast<u8*>(mapping);
+            this->capacity = size;
+            return true;
+        }
+
+        void unmap(void) {
+            if(this->base == nullptr) return;
+            ::munmap(this->base, this->capacity);
+            this->base = nullptr;
+            this->capacity = 0;
+        }
+
+        int fd = -1;
+        u8* base = nullptr;
+        std::size_t capacity = 0;
+        std::size_t position_ = 0;
+        std::size_t size_ = 0;      // Written size of the file
+        int error_ = 0;
+    };
+} // namespace AACMP4
+#endif
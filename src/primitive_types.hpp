@@ -6,6 +6,7 @@
 
 #pragma once
 
+#include <cstddef>
 #include <cstdint>
 
 namespace AACMP4 {
@@ -57,12 +58,22 @@ namespace AACMP4 {
             std::uint8_t(value >> 8), 
             std::uint8_t(value),
         } {}
-        constexpr operator std::uint32_t() const {
-            return (static_cast<std::uint32_t>(this->octets[0]) << 24)
-                 | (static_cast<std::uint32_t>(this->octets[1]) << 16)
-                 | (static_cast<std::uint32_t>(this->octets[2]) <<  8)
-                 | (static_cast<std::uint32_t>(this->octets[3]) <<  0)
+        constexpr operator std::uint64_t() const {
+            return (static_cast<std::uint64_t>(this->octets[0]) << 56)
+                 | (static_cast<std::uint64_t>(this->octets[1]) << 48)
+                 | (static_cast<std::uint64_t>(this->octets[2]) << 40)
+                 | (static_cast<std::uint64_t>(this->octets[3]) << 32)
+                 | (static_cast<std::uint64_t>(this->octets[4]) << 24)
+                 | (static_cast<std::uint64_t>(this->octets[5]) << 16)
+                 | (static_cast<std::uint64_t>(this->octets[6]) <<  8)
+                 | (static_cast<std::uint64_t>(this->octets[7]) <<  0)
                  ;
         }
     };
+
+    // A contiguous range of bytes, e.g. a segment to be written or a view of a frame.
+    struct Segment {
+        const u8* data;
+        std::size_t size;
+    };
 } // namespace AACMP4
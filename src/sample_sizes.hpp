@@ -0,0 +1,130 @@
+// SPDX-License-Identifier: BSL-1.0
+// Copyright Kenta Ida 2023.
+// Distributed under the Boost Software License, Version 1.0.
+//    (See accompanying file LICENSE_1_0.txt or copy at
+//          https://www.boost.org/LICENSE_1_0.txt)
+
+#pragma once
+
+#include <cstdint>
+#include <type_traits>
+
+#include "primitive_types.hpp"
+
+#if defined(__AVX2__) || defined(__SSE4_1__)
+#include <immintrin.h>
+#endif
+#if defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+namespace AACMP4 {
+    // Summary of a sequence of frame sizes.
+    struct SampleSizeStats {
+        std::uint64_t total_size = 0;
+        std::uint32_t max_size = 0;
+        std::size_t count = 0;
+
+        void merge(const SampleSizeStats& other) {
+            this->total_size += other.total_size;
+            this->max_size = other.max_size > this->max_size ? other.max_size : this->max_size;
+            this->count += other.count;
+        }
+    };
+
+    // Stores native frame sizes as big-endian u32 values and sums them up in the same pass.
+    // T is std::uint32_t or std::uint16_t. Uses AVX2, SSE4.1 or NEON if the target supports it.
+    template<typename T>
+    static SampleSizeStats encode_sample_sizes(u32* out, const T* sizes, std::size_t count) {
+        static_assert(std::is_same<T, std::uint32_t>::value || std::is_same<T, std::uint16_t>::value, "sizes must be std::uint32_t or std::uint16_t");
+        SampleSizeStats stats;
+        stats.count = count;
+        std::size_t i = 0;
+
+#if defined(__AVX2__)
+        {
+            std::uint8_t* dst = reinterpret_cast<std::uint8_t*>(out);
+            const __m256i swap = _mm256_setr_epi8(3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12,
+                                                  3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12);
+            __m256i total = _mm256_setzero_si256();
+            __m256i max = _mm256_setzero_si256();
+            for(; i + 8 <= count; i += 8) {
+                __m256i values;
+                if constexpr (sizeof(T) == 4) {
+                    values = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(sizes + i));
+                }
+                else {
+                    values = _mm256_cvtepu16_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i*>(sizes + i)));
+                }
+                max = _mm256_max_epu32(max, values);
+                total = _mm256_add_epi64(total, _mm256_cvtepu32_epi64(_mm256_castsi256_si128(values)));
+                total = _mm256_add_epi64(total, _mm256_cvtepu32_epi64(_mm256_extracti128_si256(values, 1)));
+                _mm256_storeu_si256(reinterpret_cast<__m256i*>(dst + i * 4), _mm256_shuffle_epi8(values, swap));
+            }
+            alignas(32) std::uint64_t totals[4];
+            alignas(32) std::uint32_t maxes[8];
+            _mm256_store_si256(reinterpret_cast<__m256i*>(totals), total);
+            _mm256_store_si256(reinterpret_cast<__m256i*>(maxes), max);
+            for(auto value : totals) stats.total_size += value;
+            for(auto value : maxes) stats.max_size = value > stats.max_size ? value : stats.max_size;
+        }
+#elif defined(__SSE4_1__)
+        {
+            std::uint8_t* dst = reinterpret_cast<std::uint8_t*>(out);
+            const __m128i swap = _mm_setr_epi8(3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12);
+            __m128i total = _mm_setzero_si128();
+            __m128i max = _mm_setzero_si128();
+            for(; i + 4 <= count; i += 4) {
+                __m128i values;
+                if constexpr (sizeof(T) == 4) {
+                    values = _mm_loadu_si128(reinterpret_cast<const __m128i*>(sizes + i));
+                }
+                else {
+                    values = _mm_cvtepu16_epi32(_mm_loadl_epi64(reinterpret_cast<const __m128i*>(sizes + i)));
+                }
+                max = _mm_max_epu32(max, values);
+                total = _mm_add_epi64(total, _mm_cvtepu32_epi64(values));
+                total = _mm_add_epi64(total, _mm_cvtepu32_epi64(_mm_srli_si128(values, 8)));
+                _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + i * 4), _mm_shuffle_epi8(values, swap));
+            }
+            alignas(16) std::uint64_t totals[2];
+            alignas(16) std::uint32_t maxes[4];
+            _mm_store_si128(reinterpret_cast<__m128i*>(totals), total);
+            _mm_store_si128(reinterpret_cast<__m128i*>(maxes), max);
+            for(auto value : totals) stats.total_size += value;
+            for(auto value : maxes) stats.max_size = value > stats.max_size ? value : stats.max_size;
+        }
+#elif defined(__ARM_NEON)
+        {
+            std::uint8_t* dst = reinterpret_cast<std::uint8_t*>(out);
+            uint64x2_t total = vdupq_n_u64(0);
+            uint32x4_t max = vdupq_n_u32(0);
+            for(; i + 4 <= count; i += 4) {
+                uint32x4_t values;
+                if constexpr (sizeof(T) == 4) {
+                    values = vld1q_u32(reinterpret_cast<const std::uint32_t*>(sizes + i));
+                }
+                else {
+                    values = vmovl_u16(vld1_u16(reinterpret_cast<const std::uint16_t*>(sizes + i)));
+                }
+                max = vmaxq_u32(max, values);
+                total = vpadalq_u32(total, values);
+                vst1q_u8(dst + i * 4, vrev32q_u8(vreinterpretq_u8_u32(values)));
+            }
+            std::uint64_t totals[2];
+            std::uint32_t maxes[4];
+            vst1q_u64(totals, total);
+            vst1q_u32(maxes, max);
+            for(auto value : totals) stats.total_size += value;
+            for(auto value : maxes) stats.max_size = value > stats.max_size ? value : stats.max_size;
+        }
+#endif
+        for(; i < count; i++) {
+            const std::uint32_t value = sizes[i];
+            out[i] = value;
+            stats.total_size += value;
+            stats.max_size = value > stats.max_size ? value : stats.max_size;
+        }
+        return stats;
+    }
+} // namespace AACMP4
@@ -0,0 +1,84 @@
+// SPDX-License-Identifier: BSL-1.0
+// Copyright Kenta Ida 2023.
+// Distributed under the Boost Software License, Version 1.0.
+//    (See accompanying file LICENSE_1_0.txt or copy at
+//          https://www.boost.org/LICENSE_1_0.txt)
+
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <vector>
+
+#include "aacmp4.hpp"
+#include "primitive_types.hpp"
+
+namespace AACMP4 {
+    // Payload buffer made of fixed-size blocks.
+    // It grows one block at a time, and the bytes already stored are never moved, unlike a std::vector<u8>
+    // grown with resize(). A frame is never split across blocks, so the encoder can write into acquire() directly.
+    // The filled part of each block is one segment of segments(), to be passed to write_aac_mp4().
+    class SegmentBuffer {
+    public:
+        static constexpr std::size_t DEFAULT_BLOCK_SIZE = 64 * 1024;
+
+        SegmentBuffer(std::size_t block_size = DEFAULT_BLOCK_SIZE) : block_size(block_size) {}
+        SegmentBuffer(const SegmentBuffer&) = delete;
+        SegmentBuffer& operator=(const SegmentBuffer&) = delete;
+
+        // Returns space for up to max_size bytes, e.g. maxOutBufBytes of fdk-aac, starting a new block if the
+        // current one has less room. A request larger than the block size gets a block of its own.
+        u8* acquire(std::size_t max_size) {
+            if(this->blocks.empty() || this->block_capacities.back() - this->segments_.back().size < max_size) {
+                const std::size_t capacity = max_size > this->block_size ? max_size : this->block_size;
+                this->blocks.emplace_back(new u8[capacity]);
+                this->block_capacities.push_back(capacity);
+                this->segments_.push_back(Segment{this->blocks.back().get(), 0});
+            }
+            return this->blocks.back().get() + this->segments_.back().size;
+        }
+        // Keeps size bytes written into the space returned by the last acquire().
+        void commit(std::size_t size) {
+            this->segments_.back().size += size;
+            this->size_ += size;
+        }
+        // Copies size bytes to the end of the buffer.
+        void append(const u8* data, std::size_t size) {
+            std::memcpy(this->acquire(size), data, size);
+            this->commit(size);
+        }
+        // Releases the blocks.
+        void clear(void) {
+            this->blocks.clear();
+            this->block_capacities.clear();
+            this->segments_.clear();
+            this->size_ = 0;
+        }
+
+        const Segment* segments(void) const { return this->segments_.data(); }
+        std::size_t number_of_segments(void) const { return this->segments_.size(); }
+        // Number of bytes stored.
+        std::uint64_t size(void) const { return this->size_; }
+        // Number of bytes allocated for the blocks.
+        std::uint64_t capacity(void) const {
+            std::uint64_t capacity = 0;
+            for(const auto block_capacity : this->block_capacities) {
+                capacity += block_capacity;
+            }
+            return capacity;
+        }
+    private:
+        std::size_t block_size;
+        std::vector<std::unique_ptr<u8[]>> blocks;
+        std::vector<std::size_t> block_capacities;
+        std::vector<Segment> segments_;     // The filled part of each block
+        std::uint64_t size_ = 0;
+    };
+
+    // Writes an AAC MP4 file from native frame sizes and the payload stored in a SegmentBuffer.
+    template<typename S, typename T>
+    static void write_aac_mp4(S& stream, const T* sizes, std::size_t number_of_frames, const SegmentBuffer& data, std::uint32_t sample_rate, std::uint32_t number_of_samples, std::uint32_t samples_per_frame) {
+        write_aac_mp4(stream, sizes, number_of_frames, data.segments(), data.number_of_segments(), sample_rate, number_of_samples, samples_per_frame);
+    }
+} // namespace AACMP4
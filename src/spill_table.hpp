@@ -0,0 +1,162 @@
+// SPDX-License-Identifier: BSL-1.0
+// Copyright Kenta Ida 2023.
+// Distributed under the Boost Software License, Version 1.0.
+//    (See accompanying file LICENSE_1_0.txt or copy at
+//          https://www.boost.org/LICENSE_1_0.txt)
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <limits>
+#include <type_traits>
+#include <vector>
+
+#include "storage.hpp"
+
+#if __has_include(<unistd.h>) && __has_include(<fcntl.h>)
+#define AACMP4_HAS_SPILL_TABLE
+#include <cerrno>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+#ifdef AACMP4_HAS_SPILL_TABLE
+namespace AACMP4 {
+    // Table which keeps only the last window_size entries in memory and appends the rest to a sidecar file.
+    // The entries are read back block by block with for_each_block(), so the memory use does not grow with the table.
+    // The sidecar file is unlinked as soon as it is opened; it disappears when closed or when the process exits.
+    // If writing the sidecar fails, the error is kept in error() and max_size() drops to size() so that
+    // no more entries are accepted. If reading it back fails, the error is kept in error() as well.
+    template<typename T>
+    class SpillVector {
+    public:
+        using value_type = T;
+        static constexpr std::size_t BLOCK_SIZE = 1024;
+
+        SpillVector() = default;
+        SpillVector(const SpillVector&) = delete;
+        SpillVector& operator=(const SpillVector&) = delete;
+        ~SpillVector() { this->close(); }
+
+        bool open(const char* path, std::size_t window_size = 4096) {
+            this->close();
+            this->fd = ::open(path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+            if(this->fd < 0) {
+                this->error_ = errno;
+                return false;
+            }
+            ::unlink(path);
+            this->window_size = window_size > 0 ? window_size : 1;
+            this->window.clear();
+            this->window.reserve(this->window_size);
+            this->spilled = 0;
+            this->error_ = 0;
+            return true;
+        }
+        void close(void) {
+            if(this->fd >= 0) {
+                ::close(this->fd);
+                this->fd = -1;
+            }
+        }
+
+        std::size_t size(void) const { return this->spilled + this->window.size(); }
+        std::size_t max_size(void) const {
+            return this->fd < 0 || this->error_ != 0 ? this->size() : std::numeric_limits<std::size_t>::max() / sizeof(T);
+        }
+        bool empty(void) const { return this->size() == 0; }
+        // Number of entries in the sidecar file.
+        std::size_t spilled_size(void) const { return this->spilled; }
+        int error(void) const { return this->error_; }
+
+        bool push_back(const T& value) {
+            if(this->window.size() == this->window_size && !this->spill()) return false;
+            this->window.push_back(value);
+            return true;
+        }
+        bool append(const T* values, std::size_t count) {
+            for(std::size_t i = 0; i < count; i++) {
+                if(!this->push_back(values[i])) return false;
+            }
+            return true;
+        }
+        void clear(void) {
+            this->window.clear();
+            this->spilled = 0;
+            if(this->fd >= 0 && ::ftruncate(this->fd, 0) != 0) {
+                this->error_ = errno;
+            }
+        }
+
+        // Calls f(values, count) for the entries in the sidecar file and then for the window.
+        template<typename F>
+        void for_each_block(F&& f) const {
+            T buffer[BLOCK_SIZE];
+            for(std::size_t index = 0; index < this->spilled; ) {
+                const std::size_t count = this->spilled - index < BLOCK_SIZE ? this->spilled - index : BLOCK_SIZE;
+                if(!this->read_at(index, buffer, count)) {
+                    // Keep the number of entries so that the box stays consistent with its header.
+                    std::memset(static_cast<void*>(buffer), 0, sizeof(buffer));
+                }
+                f(static_cast<const T*>(buffer), count);
+                index += count;
+            }
+            f(static_cast<const T*>(this->window.data()), this->window.size());
+        }
+    private:
+        static_assert(std::is_trivially_copyable<T>::value, "entries are stored as raw bytes");
+
+        bool spill(void) {
+            const std::uint8_t* data = reinterpret_cast<const std::uint8_t*>(this->window.data());
+            std::size_t remaining = this->window.size() * sizeof(T);
+            off_t offset = off_t(this->spilled * sizeof(T));
+            while(remaining > 0) {
+                ssize_t result = ::pwrite(this->fd, data, remaining, offset);
+                if(result < 0) {
+                    if(errno == EINTR) continue;
+                    this->error_ = errno;
+                    return false;
+                }
+                data += result;
+                offset += result;
+                remaining -= std::size_t(result);
+            }
+            this->spilled += this->window.size();
+            this->window.clear();
+            return true;
+        }
+        bool read_at(std::size_t index, T* values, std::size_t count) const {
+            std::uint8_t* data = reinterpret_cast<std::uint8_t*>(values);
+            std::size_t remaining = count * sizeof(T);
+            off_t offset = off_t(index * sizeof(T));
+            while(remaining > 0) {
+                ssize_t result = ::pread(this->fd, data, remaining, offset);
+                if(result < 0 && errno == EINTR) continue;
+                if(result <= 0) {
+                    if(this->error_ == 0) this->error_ = result < 0 ? errno : EIO;
+                    return false;
+                }
+                data += result;
+                offset += result;
+                remaining -= std::size_t(result);
+            }
+            return true;
+        }
+
+        int fd = -1;
+        mutable int error_ = 0;     // Also set while reading back in for_each_block()
+        std::size_t window_size = 0;
+        std::size_t spilled = 0;
+        std::vector<T> window;
+    };
+
+    // The sample sizes go to a SpillVector, which must be opened before use. The other tables stay in std::vector.
+    // The chunk offsets are not spilled: with one chunk per second they take about 700KB a day.
+    struct SpillStorage {
+        static constexpr bool allocates = true;
+        template<typename T, Table K> using Container = typename std::conditional<K == Table::SampleSizes, SpillVector<T>, std::vector<T>>::type;
+    };
+} // namespace AACMP4
+#endif // AACMP4_HAS_SPILL_TABLE
@@ -0,0 +1,180 @@
+// SPDX-License-Identifier: BSL-1.0
+// Copyright Kenta Ida 2023.
+// Distributed under the Boost Software License, Version 1.0.
+//    (See accompanying file LICENSE_1_0.txt or copy at
+//          https://www.boost.org/LICENSE_1_0.txt)
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <new>
+#include <vector>
+
+namespace AACMP4 {
+    // Variable-length tables in the box tree. A storage policy may give each of them a different capacity.
+    enum class Table {
+        SampleSizes,        // stsz entries, one per frame
+        ChunkOffsets,       // stco entries, one per chunk
+        ChunkRuns,          // stsc entries, one per change of the number of frames per chunk
+        SampleDescriptions, // stsd entries
+        FragmentSamples,    // trun entries, one per frame in a fragment
+        EditEntries,        // elst entries, one per edit
+    };
+
+    // Vector with inline storage of N elements. Never allocates.
+    // push_back() and resize() beyond the capacity are ignored and return false.
+    template<typename T, std::size_t N>
+    class StaticVector {
+    public:
+        std::size_t size(void) const { return this->count; }
+        constexpr std::size_t max_size(void) const { return N; }
+        constexpr std::size_t capacity(void) const { return N; }
+        bool empty(void) const { return this->count == 0; }
+
+        T* data(void) { return this->items; }
+        const T* data(void) const { return this->items; }
+        T* begin(void) { return this->items; }
+        const T* begin(void) const { return this->items; }
+        T* end(void) { return this->items + this->count; }
+        const T* end(void) const { return this->items + this->count; }
+        T& operator[](std::size_t i) { return this->items[i]; }
+        const T& operator[](std::size_t i) const { return this->items[i]; }
+        T& back(void) { return this->items[this->count - 1]; }
+        const T& back(void) const { return this->items[this->count - 1]; }
+
+        bool push_back(const T& value) {
+            if(this->count == N) return false;
+            this->items[this->count++] = value;
+            return true;
+        }
+        bool resize(std::size_t size) {
+            if(size > N) return false;
+            this->count = size;
+            return true;
+        }
+        template<typename I>
+        bool assign(I first, I last) {
+            this->count = 0;
+            for(; first != last; ++first) {
+                if(!this->push_back(*first)) return false;
+            }
+            return true;
+        }
+        void reserve(std::size_t) {}
+        void clear(void) { this->count = 0; }
+    private:
+        T items[N];
+        std::size_t count = 0;
+    };
+
+    // Caller-provided memory from which fixed-capacity tables are carved.
+    // Nothing is freed individually; the whole arena is released by its owner.
+    class Arena {
+    public:
+        Arena(void* buffer, std::size_t size) : buffer(static_cast<std::uint8_t*>(buffer)), size(size) {}
+
+        // Returns storage for count elements of T, or nullptr if the arena is exhausted.
+        template<typename T>
+        T* allocate(std::size_t count) {
+            const std::uintptr_t address = reinterpret_cast<std::uintptr_t>(this->buffer + this->used_size);
+            const std::size_t padding = (alignof(T) - address % alignof(T)) % alignof(T);
+            if(padding > this->size - this->used_size || count > (this->size - this->used_size - padding) / sizeof(T)) {
+                return nullptr;
+            }
+            T* items = reinterpret_cast<T*>(this->buffer + this->used_size + padding);
+            this->used_size += padding + count * sizeof(T);
+            return items;
+        }
+
+        std::size_t used(void) const { return this->used_size; }
+        std::size_t remaining(void) const { return this->size - this->used_size; }
+    private:
+        std::uint8_t* buffer;
+        std::size_t size;
+        std::size_t used_size = 0;
+    };
+
+    // Vector over memory attached from an Arena. Has no capacity until attach() is called.
+    // push_back() and resize() beyond the capacity are ignored and return false.
+    template<typename T>
+    class ArenaVector {
+    public:
+        bool attach(Arena& arena, std::size_t capacity) {
+            this->items = arena.allocate<T>(capacity);
+            this->count = 0;
+            this->capacity_ = this->items != nullptr ? capacity : 0;
+            return this->items != nullptr;
+        }
+
+        std::size_t size(void) const { return this->count; }
+        std::size_t max_size(void) const { return this->capacity_; }
+        std::size_t capacity(void) const { return this->capacity_; }
+        bool empty(void) const { return this->count == 0; }
+
+        T* data(void) { return this->items; }
+        const T* data(void) const { return this->items; }
+        T* begin(void) { return this->items; }
+        const T* begin(void) const { return this->items; }
+        T* end(void) { return this->items + this->count; }
+        const T* end(void) const { return this->items + this->count; }
+        T& operator[](std::size_t i) { return this->items[i]; }
+        const T& operator[](std::size_t i) const { return this->items[i]; }
+        T& back(void) { return this->items[this->count - 1]; }
+        const T& back(void) const { return this->items[this->count - 1]; }
+
+        bool push_back(const T& value) {
+            if(this->count == this->capacity_) return false;
+            this->items[this->count++] = value;
+            return true;
+        }
+        bool resize(std::size_t size) {
+            if(size > this->capacity_) return false;
+            for(std::size_t i = this->count; i < size; i++) {
+                new (this->items + i) T();
+            }
+            this->count = size;
+            return true;
+        }
+        template<typename I>
+        bool assign(I first, I last) {
+            this->count = 0;
+            for(; first != last; ++first) {
+                if(!this->push_back(*first)) return false;
+            }
+            return true;
+        }
+        void reserve(std::size_t) {}
+        void clear(void) { this->count = 0; }
+    private:
+        T* items = nullptr;
+        std::size_t count = 0;
+        std::size_t capacity_ = 0;
+    };
+
+    // Tables in std::vector. The default.
+    struct HeapStorage {
+        static constexpr bool allocates = true;
+        template<typename T, Table> using Container = std::vector<T>;
+    };
+
+    // Tables in arrays inside the boxes. Suitable for a statically allocated writer.
+    template<std::size_t MaxSamples, std::size_t MaxChunks = 1, std::size_t MaxChunkRuns = 2, std::size_t MaxSampleDescriptions = 1, std::size_t MaxEdits = 1>
+    struct StaticStorage {
+        static constexpr bool allocates = false;
+        static constexpr std::size_t capacity(Table table) {
+            return table == Table::ChunkOffsets ? MaxChunks
+                : table == Table::ChunkRuns ? MaxChunkRuns
+                : table == Table::SampleDescriptions ? MaxSampleDescriptions
+                : table == Table::EditEntries ? MaxEdits
+                : MaxSamples;
+        }
+        template<typename T, Table K> using Container = StaticVector<T, capacity(K)>;
+    };
+
+    // Tables in memory attached from a caller-provided Arena.
+    struct ArenaStorage {
+        static constexpr bool allocates = false;
+        template<typename T, Table> using Container = ArenaVector<T>;
+    };
+} // namespace AACMP4
@@ -7,9 +7,36 @@
 #pragma once
 
 #include <cstdint>
+#include <cstring>
+#include <type_traits>
+#include <utility>
+#include <vector>
 #include "primitive_types.hpp"
 
+#if __has_include(<sys/uio.h>) && __has_include(<unistd.h>)
+#include <cerrno>
+#include <climits>
+#include <sys/uio.h>
+#include <unistd.h>
+#if defined(__linux__)
+#include <fcntl.h>
+#endif
+#define AACMP4_HAS_FD_SINK 1
+#endif
+
 namespace AACMP4 {
+    // True if the sink can push the written bytes towards the storage with sync().
+    template<typename S, typename = void>
+    struct has_sync : std::false_type {};
+    template<typename S>
+    struct has_sync<S, decltype(std::declval<S&>().sync(), void())> : std::true_type {};
+
+    // True if the sink can start writing back the written bytes without waiting with start_writeback().
+    template<typename S, typename = void>
+    struct has_start_writeback : std::false_type {};
+    template<typename S>
+    struct has_start_writeback<S, decltype(std::declval<S&>().start_writeback(), void())> : std::true_type {};
+
     template<typename T>
     struct StreamAdapter {
         T& stream;
@@ -21,5 +48,255 @@ namespace AACMP4 {
         std::size_t position(void) {
             return this->stream.tellp();
         }
+        // Overwrites already written bytes at the given position, then restores the write position.
+        void write_at(std::size_t position, const u8* data, std::size_t size) {
+            auto current = this->stream.tellp();
+            this->stream.seekp(position);
+            this->stream.write(reinterpret_cast<const char*>(data), size);
+            this->stream.seekp(current);
+        }
+        // Reads back already written bytes. Available only if the stream is also an input stream.
+        template<typename U = T>
+        auto read_at(std::size_t position, u8* data, std::size_t size) -> decltype(std::declval<U&>().read(reinterpret_cast<char*>(data), size), void()) {
+            auto current = this->stream.tellp();
+            this->stream.seekg(position);
+            this->stream.read(reinterpret_cast<char*>(data), size);
+            this->stream.seekp(current);
+        }
+        // Passes the buffered bytes to the OS. A standard stream cannot wait for the storage;
+        // use FdSink or MmapSink when the data must survive a power loss.
+        void sync(void) {
+            this->stream.flush();
+        }
+    };
+
+    // Gathers small writes into a fixed-size staging buffer and passes them to the underlying sink in large blocks.
+    // Writes not smaller than the buffer are passed through without being copied.
+    template<typename S, std::size_t N = 4096>
+    struct BufferedSink {
+        S& stream;
+        u8 buffer[N];
+        std::size_t buffered = 0;
+
+        BufferedSink(S& stream) : stream(stream) {}
+        ~BufferedSink() { this->flush(); }
+
+        void write(const u8* data, std::size_t size) {
+            if(size >= N) {
+                this->flush();
+                this->stream.write(data, size);
+                return;
+            }
+            if(this->buffered + size > N) {
+                this->flush();
+            }
+            std::memcpy(this->buffer + this->buffered, data, size);
+            this->buffered += size;
+        }
+        std::size_t position(void) {
+            return this->stream.position() + this->buffered;
+        }
+        void write_at(std::size_t position, const u8* data, std::size_t size) {
+            this->flush();
+            this->stream.write_at(position, data, size);
+        }
+        template<typename U = S>
+        auto read_at(std::size_t position, u8* data, std::size_t size) -> decltype(std::declval<U&>().read_at(position, data, size), void()) {
+            this->flush();
+            this->stream.read_at(position, data, size);
+        }
+        void flush(void) {
+            if(this->buffered == 0) return;
+            this->stream.write(this->buffer, this->buffered);
+            this->buffered = 0;
+        }
+        template<typename U = S>
+        auto sync(void) -> decltype(std::declval<U&>().sync(), void()) {
+            this->flush();
+            this->stream.sync();
+        }
+        template<typename U = S>
+        auto start_writeback(void) -> decltype(std::declval<U&>().start_writeback(), void()) {
+            this->flush();
+            this->stream.start_writeback();
+        }
+    };
+
+    // Writes sequentially from the given position of a stream by write_at(), gathering small writes into a buffer.
+    template<typename S>
+    struct PositionedStream {
+        S& stream;
+        std::size_t position_;
+        u8 buffer[4096];
+        std::size_t buffered = 0;
+
+        PositionedStream(S& stream, std::size_t position) : stream(stream), position_(position) {}
+        ~PositionedStream() { this->flush(); }
+
+        void write(const u8* data, std::size_t size) {
+            if(this->buffered + size > sizeof(this->buffer)) {
+                this->flush();
+            }
+            if(size >= sizeof(this->buffer)) {
+                this->stream.write_at(this->position_, data, size);
+                this->position_ += size;
+                return;
+            }
+            std::memcpy(this->buffer + this->buffered, data, size);
+            this->buffered += size;
+        }
+        std::size_t position(void) const {
+            return this->position_ + this->buffered;
+        }
+        void flush(void) {
+            if(this->buffered == 0) return;
+            this->stream.write_at(this->position_, this->buffer, this->buffered);
+            this->position_ += this->buffered;
+            this->buffered = 0;
+        }
+    };
+
+#ifdef AACMP4_HAS_FD_SINK
+    // Writes to a POSIX file descriptor with scatter/gather I/O.
+    // Small writes are copied into a staging buffer. A write not smaller than gather_threshold, or a list of
+    // segments passed to write_segments(), is submitted together with the staged bytes by a single writev()
+    // without being copied. The position is tracked by the sink, so the descriptor must not be written by others.
+    // The first error is kept in error() and the following writes are ignored.
+    struct FdSink {
+        int fd;
+        std::size_t gather_threshold;
+        std::uint64_t position_ = 0;    // Position of the first staged byte
+        std::vector<u8> staging;
+        std::size_t staged = 0;
+        std::uint64_t writeback_position = 0;   // End of the bytes passed to start_writeback() or sync()
+        int error_ = 0;
+
+        FdSink(int fd, std::size_t staging_size = 64 * 1024, std::size_t gather_threshold = 4096)
+            : fd(fd), gather_threshold(gather_threshold), staging(staging_size)
+        {
+            off_t current = ::lseek(fd, 0, SEEK_CUR);
+            this->position_ = current < 0 ? 0 : std::uint64_t(current);
+            this->writeback_position = this->position_;
+        }
+        ~FdSink() { this->flush(); }
+
+        void write(const u8* data, std::size_t size) {
+            if(size >= this->gather_threshold || size > this->staging.size()) {
+                Segment segment = {data, size};
+                this->write_segments(&segment, 1);
+                return;
+            }
+            if(this->staged + size > this->staging.size()) {
+                this->flush();
+            }
+            std::memcpy(this->staging.data() + this->staged, data, size);
+            this->staged += size;
+        }
+        // Writes the staged bytes followed by the segments.
+        void write_segments(const Segment* segments, std::size_t count) {
+            struct iovec iov[BATCH];
+            std::size_t used = 0;
+            if(this->staged > 0) {
+                iov[used++] = {this->staging.data(), this->staged};
+                this->staged = 0;
+            }
+            for(std::size_t i = 0; i < count; i++) {
+                if(segments[i].size == 0) continue;
+                if(used == BATCH) {
+                    this->submit(iov, used);
+                    used = 0;
+                }
+                iov[used++] = {const_cast<u8*>(segments[i].data), segments[i].size};
+            }
+            this->submit(iov, used);
+        }
+        std::size_t position(void) const {
+            return this->position_ + this->staged;
+        }
+        void write_at(std::size_t position, const u8* data, std::size_t size) {
+            this->flush();
+            while(size > 0 && this->error_ == 0) {
+                ssize_t written = ::pwrite(this->fd, data, size, off_t(position));
+                if(written < 0) {
+                    if(errno != EINTR) this->error_ = errno;
+                    continue;
+                }
+                data += written;
+                position += written;
+                size -= written;
+            }
+        }
+        void read_at(std::size_t position, u8* data, std::size_t size) {
+            this->flush();
+            while(size > 0 && this->error_ == 0) {
+                ssize_t bytes_read = ::pread(this->fd, data, size, off_t(position));
+                if(bytes_read <= 0) {
+                    if(bytes_read == 0) this->error_ = EIO;
+                    else if(errno != EINTR) this->error_ = errno;
+                    continue;
+                }
+                data += bytes_read;
+                position += bytes_read;
+                size -= bytes_read;
+            }
+        }
+        void flush(void) {
+            this->write_segments(nullptr, 0);
+        }
+        // Writes the staged bytes and waits until the written data reaches the storage.
+        void sync(void) {
+            this->flush();
+            if(this->error_ != 0) return;
+#if defined(__APPLE__)
+            while(::fsync(this->fd) != 0) {
+#else
+            while(::fdatasync(this->fd) != 0) {
+#endif
+                if(errno != EINTR) {
+                    this->error_ = errno;
+                    break;
+                }
+            }
+            this->writeback_position = this->position_;
+        }
+        // Writes the staged bytes and starts writing back the bytes appended since the last call without
+        // waiting for them, so that the next sync() has less to wait for. A hint; does nothing outside Linux.
+        void start_writeback(void) {
+            this->flush();
+            if(this->error_ != 0 || this->position_ <= this->writeback_position) return;
+#if defined(__linux__)
+            ::sync_file_range(this->fd, off_t(this->writeback_position), off_t(this->position_ - this->writeback_position), SYNC_FILE_RANGE_WRITE);
+#endif
+            this->writeback_position = this->position_;
+        }
+        int error(void) const { return this->error_; }
+    private:
+#ifdef IOV_MAX
+        static constexpr std::size_t BATCH = IOV_MAX < 64 ? IOV_MAX : 64;
+#else
+        static constexpr std::size_t BATCH = 16;
+#endif
+
+        void submit(struct iovec* iov, std::size_t count) {
+            while(count > 0 && this->error_ == 0) {
+                ssize_t written = ::writev(this->fd, iov, int(count));
+                if(written < 0) {
+                    if(errno != EINTR) this->error_ = errno;
+                    continue;
+                }
+                this->position_ += written;
+                // Skip the fully written vectors and advance into a partially written one.
+                while(count > 0 && std::size_t(written) >= iov->iov_len) {
+                    written -= iov->iov_len;
+                    iov++;
+                    count--;
+                }
+                if(count > 0) {
+                    iov->iov_base = static_cast<u8*>(iov->iov_base) + written;
+                    iov->iov_len -= written;
+                }
+            }
+        }
     };
-} // namespace AACMP4
\ No newline at end of file
+#endif
+} // namespace AACMP4